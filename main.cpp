@@ -1,11 +1,22 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <deque>
 #include <iostream>
+#include <mutex>
 #include <queue>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
 #define UNREACHABLE -1
 #define UNVISITED -1
 
@@ -73,6 +84,264 @@ struct PathData
     }
 };
 
+// One bit per cell, indexed by x + y * width. Boards up to MAX_CELLS cells.
+typedef unsigned __int128 Bitboard;
+
+#define MAX_CELLS 128
+#define MAX_SLOTS 128
+
+// Everything about one wall slot that placement and overlap checks need
+struct WallSlot
+{
+    int x;
+    int y;
+    bool horizontal;
+    Bitboard edges;     // cells whose upper (horizontal) or left (vertical) edge it blocks
+    Bitboard overlaps;  // slots sharing an edge with it, itself included
+    Bitboard conflicts; // overlaps plus the slot crossing it
+    int corners[3];     // union-find nodes of its corners, border corners are 0
+};
+
+// Slots are numbered horizontal first, then vertical, each row by row.
+// Bitboards over slots use the same type as bitboards over cells.
+struct WallSlotTable
+{
+    int width;
+    int height;
+    int slot_count;
+    WallSlot slots[MAX_SLOTS];
+    Bitboard up_edge_slots[MAX_CELLS];   // slots that could block the edge above a cell
+    Bitboard left_edge_slots[MAX_CELLS]; // slots that could block the edge left of a cell
+
+    constexpr int get_slot_index(int x, int y, bool horizontal) const
+    {
+        if (horizontal)
+            return x + (y - 1) * (width - 1);
+        return (width - 1) * (height - 1) + (x - 1) + y * (width - 1);
+    }
+
+    constexpr bool is_slot_inside(int x, int y, bool horizontal) const
+    {
+        if (horizontal)
+            return x >= 0 && x < width - 1 && y >= 1 && y < height;
+        return x >= 1 && x < width && y >= 0 && y < height - 1;
+    }
+
+    constexpr Bitboard get_slot_bit(int x, int y, bool horizontal) const
+    {
+        if (!is_slot_inside(x, y, horizontal))
+            return 0;
+        return (Bitboard)1 << get_slot_index(x, y, horizontal);
+    }
+
+    constexpr int get_corner(int x, int y) const
+    {
+        if (x == 0 || y == 0 || x == width || y == height)
+            return 0;
+        return x + y * (width + 1);
+    }
+};
+
+constexpr WallSlotTable make_wall_slot_table(int width, int height)
+{
+    WallSlotTable table{};
+    table.width = width;
+    table.height = height;
+    table.slot_count = 2 * (width - 1) * (height - 1);
+
+    for (int i = 0; i < table.slot_count; i++)
+    {
+        bool horizontal = i < (width - 1) * (height - 1);
+        int index = horizontal ? i : i - (width - 1) * (height - 1);
+        int x = index % (width - 1) + (horizontal ? 0 : 1);
+        int y = index / (width - 1) + (horizontal ? 1 : 0);
+
+        WallSlot &slot = table.slots[i];
+        slot.x = x;
+        slot.y = y;
+        slot.horizontal = horizontal;
+        Bitboard bit = (Bitboard)1 << i;
+        if (horizontal)
+        {
+            Bitboard first = (Bitboard)1 << (x + y * width);
+            slot.edges = first | (first << 1);
+            slot.overlaps = table.get_slot_bit(x - 1, y, true) | bit | table.get_slot_bit(x + 1, y, true);
+            slot.conflicts = slot.overlaps | table.get_slot_bit(x + 1, y - 1, false);
+            table.up_edge_slots[x + y * width] |= bit;
+            table.up_edge_slots[x + 1 + y * width] |= bit;
+        }
+        else
+        {
+            Bitboard first = (Bitboard)1 << (x + y * width);
+            slot.edges = first | (first << width);
+            slot.overlaps = table.get_slot_bit(x, y - 1, false) | bit | table.get_slot_bit(x, y + 1, false);
+            slot.conflicts = slot.overlaps | table.get_slot_bit(x - 1, y + 1, true);
+            table.left_edge_slots[x + y * width] |= bit;
+            table.left_edge_slots[x + (y + 1) * width] |= bit;
+        }
+        for (int j = 0; j < 3; j++)
+            slot.corners[j] = horizontal ? table.get_corner(x + j, y) : table.get_corner(x, y + j);
+    }
+
+    return table;
+}
+
+// Production boards are 9x9, other sizes build their table at startup
+constexpr WallSlotTable WALL_SLOTS_9X9 = make_wall_slot_table(9, 9);
+
+#define MAX_PLAYERS 3
+#define MAX_WALLS_LEFT 20
+
+// Random keys for hashing positions, one per wall slot, pawn square,
+// walls left count, player flag and side to move
+struct ZobristKeys
+{
+    uint64_t walls[MAX_SLOTS];
+    uint64_t pawns[MAX_PLAYERS][MAX_CELLS];
+    uint64_t walls_left[MAX_PLAYERS][MAX_WALLS_LEFT + 1];
+    uint64_t alive[MAX_PLAYERS];
+    uint64_t finished[MAX_PLAYERS];
+    uint64_t side_to_move[MAX_PLAYERS];
+};
+
+constexpr uint64_t next_random(uint64_t &state)
+{
+    // splitmix64
+    state += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+constexpr ZobristKeys make_zobrist_keys(uint64_t seed)
+{
+    ZobristKeys keys{};
+    uint64_t state = seed;
+    for (int i = 0; i < MAX_SLOTS; i++)
+        keys.walls[i] = next_random(state);
+    for (int id = 0; id < MAX_PLAYERS; id++)
+    {
+        for (int i = 0; i < MAX_CELLS; i++)
+            keys.pawns[id][i] = next_random(state);
+        for (int i = 0; i <= MAX_WALLS_LEFT; i++)
+            keys.walls_left[id][i] = next_random(state);
+        keys.alive[id] = next_random(state);
+        keys.finished[id] = next_random(state);
+        keys.side_to_move[id] = next_random(state);
+    }
+    return keys;
+}
+
+constexpr ZobristKeys ZOBRIST = make_zobrist_keys(0x5EED);
+
+int get_bit_index(Bitboard bits)
+{
+    uint64_t low = (uint64_t)bits;
+    if (low != 0)
+        return __builtin_ctzll(low);
+    return 64 + __builtin_ctzll((uint64_t)(bits >> 64));
+}
+
+#ifdef __BMI2__
+// Packs the bits selected by mask into the low bits, in order
+Bitboard extract_bits(Bitboard bits, Bitboard mask)
+{
+    uint64_t low_mask = (uint64_t)mask;
+    Bitboard low = _pext_u64((uint64_t)bits, low_mask);
+    Bitboard high = _pext_u64((uint64_t)(bits >> 64), (uint64_t)(mask >> 64));
+    return low | (high << __builtin_popcountll(low_mask));
+}
+#endif
+
+// Distance from every cell to one goal edge, kept up to date as walls are
+// placed. layers[d] holds the cells at distance d; cells in no layer are
+// cut off from the goal.
+struct DistanceField
+{
+    bool is_valid;
+    bool is_safe_valid;
+    Bitboard safe;    // cells with a shortest path through edges no wall can be placed on
+    Bitboard pending; // seeds of the walls placed since the layers were last repaired
+    Bitboard layers[MAX_CELLS];
+
+    DistanceField() : is_valid(false), is_safe_valid(false), safe(0), pending(0) {}
+
+    int get_distance(Bitboard cell)
+    {
+        for (int distance = 0; distance < MAX_CELLS && layers[distance] != 0; distance++)
+            if (layers[distance] & cell)
+                return distance;
+        return UNREACHABLE;
+    }
+};
+
+// Every shortest path from one cell to a goal edge. Edges are bits of the
+// cell below them (up) or to the right of them (left), like blocked_up and
+// blocked_left; the counts are only set for edges of the DAG.
+struct ShortestPathDag
+{
+    int distance;
+    uint64_t path_count;
+    Bitboard up;            // edges on some shortest path
+    Bitboard left;
+    Bitboard critical_up;   // edges on every shortest path
+    Bitboard critical_left;
+    uint64_t up_paths[MAX_CELLS]; // shortest paths through each edge
+    uint64_t left_paths[MAX_CELLS];
+};
+
+// What the wall of each slot does to the shortest paths of one DAG, one bit
+// per slot index. There is no lower bound on the distance after a wall: the
+// walls are always scored by placing them, which gives the exact distance.
+struct SlotThreats
+{
+    Bitboard lengthening; // walls that may lengthen the paths
+    Bitboard touching;    // walls that block or make unblockable an edge of a path
+};
+
+// Old contents of a layer, journaled when a wall changes it
+struct FieldChange
+{
+    int dir;
+    int distance;
+    Bitboard layer;
+};
+
+// What remove_wall needs to restore the fields to before the wall
+struct WallRecord
+{
+    int journal_size;
+    int chain_history_size;
+    int valid_fields;
+    int safe_fields;
+    Bitboard safe[4];
+    Bitboard pending[4];
+};
+
+// An int that is a compile time constant when N is not 0, so the engine
+// specialized on the production board size folds it into every index
+// computation. Dimension<0> holds the value read at runtime.
+template <int N>
+struct Dimension
+{
+    constexpr operator int() const { return N; }
+    Dimension &operator=(int) { return *this; }
+};
+
+template <>
+struct Dimension<0>
+{
+    int value;
+    operator int() const { return value; }
+    Dimension &operator=(int value)
+    {
+        this->value = value;
+        return *this;
+    }
+};
+
+template <int W = 0, int H = 0>
 class WallGrid
 {
 public:
@@ -80,17 +349,57 @@ public:
     {
         this->width = width;
         this->height = height;
-        this->blocked_paths = new int[width * height * width * height]{0};
-        this->visited = new PathData[width * height];
-        this->queue = new Vector2[width * height];
-    }
-    ~WallGrid()
-    {
-        delete[] blocked_paths;
-        delete[] visited;
-        delete[] queue;
+        this->wall_count = 0;
+
+        this->blocked_up = 0;
+        this->blocked_left = 0;
+        this->placed_slots = 0;
+
+        if (width == WALL_SLOTS_9X9.width && height == WALL_SLOTS_9X9.height)
+            this->slot_table = &WALL_SLOTS_9X9;
+        else
+        {
+            this->owned_slot_table = new WallSlotTable(make_wall_slot_table(width, height));
+            this->slot_table = owned_slot_table;
+        }
+
+        // Every border corner shares node 0 with the corner at (0, 0)
+        this->chain_parent.resize((width + 1) * (height + 1));
+        this->chain_size.resize((width + 1) * (height + 1));
+        for (int i = 0; i < (int)chain_parent.size(); i++)
+        {
+            chain_parent[i] = i;
+            chain_size[i] = 1;
+        }
+
+        this->up_edges = 0;
+        this->left_edges = 0;
+        this->horizontal_slots = 0;
+        this->vertical_slots = 0;
+        fill_n(goal_masks, 4, (Bitboard)0);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                Vector2 pos = Vector2(x, y);
+                Bitboard bit = get_bit(pos);
+                if (y >= 1)
+                    up_edges |= bit;
+                if (x >= 1)
+                    left_edges |= bit;
+                if (is_wall_inside(Wall(pos, true)))
+                    horizontal_slots |= bit;
+                if (is_wall_inside(Wall(pos, false)))
+                    vertical_slots |= bit;
+                for (int i = 0; i < 4; i++)
+                    if (is_finished(pos, (Direction)i))
+                        goal_masks[i] |= bit;
+            }
+        }
     }
 
+    ~WallGrid() { delete owned_slot_table; }
+
     bool is_inside(Vector2 pos)
     {
         return pos.x >= 0 && pos.x < width && pos.y >= 0 && pos.y < height;
@@ -98,17 +407,16 @@ public:
 
     int get_index(Vector2 pos) { return pos.x + pos.y * width; }
 
-    bool is_blocked(Vector2 pos1, Vector2 pos2)
-    {
-        return blocked_paths[pos1.x + pos1.y * width + pos2.x * width * height +
-                             pos2.y * width * width * height] != 0;
-    }
+    Bitboard get_bit(Vector2 pos) { return (Bitboard)1 << get_index(pos); }
 
-    int get_blocked(Vector2 pos1, Vector2 pos2)
+    bool is_blocked(Vector2 pos1, Vector2 pos2)
     {
-        // will crash if pos1 or pos2 are outside the grid
-        return blocked_paths[pos1.x + pos1.y * width + pos2.x * width * height +
-                             pos2.y * width * width * height];
+        // blocked_up holds the edge above a cell, blocked_left the edge to its left
+        if (pos1.x == pos2.x && abs(pos1.y - pos2.y) == 1)
+            return (blocked_up & get_bit(pos1.y > pos2.y ? pos1 : pos2)) != 0;
+        if (pos1.y == pos2.y && abs(pos1.x - pos2.x) == 1)
+            return (blocked_left & get_bit(pos1.x > pos2.x ? pos1 : pos2)) != 0;
+        return false;
     }
 
     int get_wall_count() { return wall_count; }
@@ -121,23 +429,47 @@ public:
             return wall.pos.x >= 1 && wall.pos.x < width && wall.pos.y >= 0 && wall.pos.y < height - 1;
     }
 
+    int get_slot_count() { return slot_table->slot_count; }
+
+    Bitboard get_all_slots()
+    {
+        int count = get_slot_count();
+        return count == MAX_SLOTS ? ~(Bitboard)0 : ((Bitboard)1 << count) - 1;
+    }
+
+    Bitboard get_placed_slots() { return placed_slots; }
+
+    int get_slot_index(Wall wall)
+    {
+        return slot_table->get_slot_index(wall.pos.x, wall.pos.y, wall.horizontal);
+    }
+
+    Wall get_slot_wall(int index)
+    {
+        const WallSlot &slot = slot_table->slots[index];
+        return Wall(Vector2(slot.x, slot.y), slot.horizontal);
+    }
+
     bool is_overlaping(Wall wall)
     {
-        if (wall.horizontal)
-        {
-            if (is_blocked(wall.pos, wall.pos + Vector2(0, -1)))
-                return true;
-            if (is_blocked(wall.pos + Vector2(1, 0), wall.pos + Vector2(1, -1)))
-                return true;
-        }
-        else
-        {
-            if (is_blocked(wall.pos, wall.pos + Vector2(-1, 0)))
-                return true;
-            if (is_blocked(wall.pos + Vector2(0, 1), wall.pos + Vector2(-1, 1)))
-                return true;
-        }
-        return false;
+        return (placed_slots & slot_table->slots[get_slot_index(wall)].overlaps) != 0;
+    }
+
+    // Overlaping or crossing an existing wall
+    bool is_conflicting(Wall wall)
+    {
+        return (placed_slots & slot_table->slots[get_slot_index(wall)].conflicts) != 0;
+    }
+
+    // A wall can only cut off a region if it joins two corners that are
+    // already connected through walls or the border, closing a loop.
+    bool closes_chain(Wall wall)
+    {
+        const int *corners = slot_table->slots[get_slot_index(wall)].corners;
+        int first = find_chain(corners[0]);
+        int middle = find_chain(corners[1]);
+        int last = find_chain(corners[2]);
+        return first == middle || middle == last || first == last;
     }
 
     void place_wall(Wall wall)
@@ -149,34 +481,74 @@ public:
         wall_count++;
 
         // Place wall
+        const WallSlot &slot = slot_table->slots[get_slot_index(wall)];
         if (wall.horizontal)
-        {
-            set_blocked(wall.pos, wall.pos + Vector2(0, -1), wall_count);
-            set_blocked(wall.pos + Vector2(1, 0), wall.pos + Vector2(1, -1),
-                        wall_count);
-        }
+            blocked_up |= slot.edges;
         else
+            blocked_left |= slot.edges;
+        placed_slots |= (Bitboard)1 << get_slot_index(wall);
+
+        WallRecord record;
+        record.journal_size = journal.size();
+        record.chain_history_size = chain_history.size();
+
+        join_chains(slot.corners[0], slot.corners[1]);
+        join_chains(slot.corners[1], slot.corners[2]);
+
+        record.valid_fields = 0;
+        record.safe_fields = 0;
+        for (int i = 0; i < 4; i++)
         {
-            set_blocked(wall.pos, wall.pos + Vector2(-1, 0), wall_count);
-            set_blocked(wall.pos + Vector2(0, 1), wall.pos + Vector2(-1, 1),
-                        wall_count);
+            DistanceField &field = fields[i];
+            record.safe[i] = field.safe;
+            record.pending[i] = field.pending;
+            if (field.is_safe_valid)
+                record.safe_fields |= 1 << i;
+            if (!field.is_valid)
+                continue;
+
+            record.valid_fields |= 1 << i;
+            field.is_safe_valid = false;
+
+            // Only the cells on either side of the blocked edges can lose their
+            // route. The repair waits for the next query of the field, so a wall
+            // removed before anyone asks never costs one.
+            field.pending |= slot.edges | (slot.edges >> (wall.horizontal ? width : 1));
         }
+        wall_records.push_back(record);
     }
 
+    // Walls must be removed in the reverse order they were placed
     void remove_wall(Wall wall)
     {
-        // Place wall
+        const WallSlot &slot = slot_table->slots[get_slot_index(wall)];
         if (wall.horizontal)
+            blocked_up &= ~slot.edges;
+        else
+            blocked_left &= ~slot.edges;
+        placed_slots &= ~((Bitboard)1 << get_slot_index(wall));
+
+        WallRecord record = wall_records.back();
+        wall_records.pop_back();
+        while ((int)chain_history.size() > record.chain_history_size)
         {
-            set_blocked(wall.pos, wall.pos + Vector2(0, -1), 0);
-            set_blocked(wall.pos + Vector2(1, 0), wall.pos + Vector2(1, -1),
-                        0);
+            int child = chain_history.back();
+            chain_size[chain_parent[child]] -= chain_size[child];
+            chain_parent[child] = child;
+            chain_history.pop_back();
         }
-        else
+        while ((int)journal.size() > record.journal_size)
+        {
+            FieldChange &change = journal.back();
+            fields[change.dir].layers[change.distance] = change.layer;
+            journal.pop_back();
+        }
+        for (int i = 0; i < 4; i++)
         {
-            set_blocked(wall.pos, wall.pos + Vector2(-1, 0), 0);
-            set_blocked(wall.pos + Vector2(0, 1), wall.pos + Vector2(-1, 1),
-                        0);
+            fields[i].is_valid = (record.valid_fields >> i) & 1;
+            fields[i].is_safe_valid = (record.safe_fields >> i) & 1;
+            fields[i].safe = record.safe[i];
+            fields[i].pending = record.pending[i];
         }
 
         wall_count--;
@@ -199,51 +571,49 @@ public:
         return false;
     }
 
+    // Slots whose wall would block the edge between two neighbouring cells
+    Bitboard get_edge_slots(Vector2 from, Vector2 to)
+    {
+        if (from.x == to.x)
+            return slot_table->up_edge_slots[get_index(from.y > to.y ? from : to)];
+        return slot_table->left_edge_slots[get_index(from.x > to.x ? from : to)];
+    }
+
     bool is_unblockable(Vector2 from, Vector2 to)
     {
-        if (from.y == to.y)
+        Bitboard slots = get_edge_slots(from, to);
+
+        // Blockable if any slot covering the edge is still free
+        for (int i = 0; i < 2 && slots != 0; i++)
         {
-            if (from.x < to.x)
-            {
-                Wall wall1 = Wall(to, false);
-                if (is_wall_inside(wall1) && !is_overlaping(wall1))
-                    return false;
-                Wall wall2 = Wall(to + Vector2(0, -1), false);
-                if (is_wall_inside(wall2) && !is_overlaping(wall2))
-                    return false;
-            }
-            else
-            {
-                Wall wall1 = Wall(from, false);
-                if (is_wall_inside(wall1) && !is_overlaping(wall1))
-                    return false;
-                Wall wall2 = Wall(from + Vector2(0, -1), false);
-                if (is_wall_inside(wall2) && !is_overlaping(wall2))
-                    return false;
-            }
+            Bitboard slot = slots & -slots;
+            slots &= ~slot;
+            if ((placed_slots & slot_table->slots[get_bit_index(slot)].overlaps) == 0)
+                return false;
         }
-        else
+        return true;
+    }
+
+    DistanceField &get_distance_field(Direction dir)
+    {
+        DistanceField &field = fields[(int)dir];
+        if (!field.is_valid)
+            compute_distance_field(dir, field);
+        if (field.pending != 0)
         {
-            if (from.y < to.y)
-            {
-                Wall wall1 = Wall(to, true);
-                if (is_wall_inside(wall1) && !is_overlaping(wall1))
-                    return false;
-                Wall wall2 = Wall(to + Vector2(-1, 0), true);
-                if (is_wall_inside(wall2) && !is_overlaping(wall2))
-                    return false;
-            }
-            else
-            {
-                Wall wall1 = Wall(from, true);
-                if (is_wall_inside(wall1) && !is_overlaping(wall1))
-                    return false;
-                Wall wall2 = Wall(from + Vector2(-1, 0), true);
-                if (is_wall_inside(wall2) && !is_overlaping(wall2))
-                    return false;
-            }
+            repair_distance_field((int)dir, field.pending);
+            field.pending = 0;
         }
-        return true;
+        return field;
+    }
+
+    // Only an unblockable first step needs the safe cells, so they are built
+    // on first use
+    Bitboard get_safe_cells(DistanceField &field)
+    {
+        if (!field.is_safe_valid)
+            compute_safe_cells(field);
+        return field.safe;
     }
 
     PathData get_path_data(Vector2 pos, Direction dir)
@@ -253,121 +623,392 @@ public:
         if (is_finished(pos, dir))
             return PathData(0, dir, true);
 
-        write_index = 0;
-        read_index = 0;
+        DistanceField &field = get_distance_field(dir);
+        int distance = field.get_distance(get_bit(pos));
+        if (distance == UNREACHABLE)
+            return PathData(UNREACHABLE, dir, true);
 
-        fill_n(visited, width * height, PathData());
+        // First step in the order UP, DOWN, LEFT, RIGHT that gets closer
+        for (int i = 0; i < 4; i++)
+        {
+            Vector2 next = pos + get_offset((Direction)i);
+            if (!is_inside(next) || is_blocked(pos, next) ||
+                (field.layers[distance - 1] & get_bit(next)) == 0)
+                continue;
 
-        visited[get_index(pos)] = PathData(0, dir, true);
+            bool unblockable = is_unblockable(pos, next) && (get_safe_cells(field) & get_bit(next)) != 0;
+            return PathData(distance, (Direction)i, unblockable);
+        }
 
-        Vector2 next = Vector2(pos.x, pos.y - 1);
-        int next_index = get_index(next);
-        if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-            !is_blocked(pos, next))
+        return PathData(UNREACHABLE, dir, true);
+    }
+
+    // One pass down the distance layers from pos collects the cells and
+    // edges of every shortest path, one pass back up counts the paths.
+    void compute_shortest_path_dag(Vector2 pos, Direction dir, ShortestPathDag &dag)
+    {
+        dag.distance = UNREACHABLE;
+        dag.path_count = 0;
+        dag.up = 0;
+        dag.left = 0;
+        dag.critical_up = 0;
+        dag.critical_left = 0;
+        if (!is_inside(pos))
+            return;
+
+        DistanceField &field = get_distance_field(dir);
+        dag.distance = field.get_distance(get_bit(pos));
+        if (dag.distance == UNREACHABLE)
+            return;
+
+        Bitboard open_up = up_edges & ~blocked_up;
+        Bitboard open_left = left_edges & ~blocked_left;
+        Bitboard cells[MAX_CELLS];
+        cells[dag.distance] = get_bit(pos);
+        for (int distance = dag.distance; distance > 0; distance--)
         {
-            visited[next_index] = PathData(1, Direction::UP, is_unblockable(pos, next));
-            queue[write_index++] = next;
+            Bitboard closer = field.layers[distance - 1];
+            Bitboard up_steps = cells[distance] & (closer << width) & open_up;
+            Bitboard down_steps = (cells[distance] << width) & closer & open_up;
+            Bitboard left_steps = cells[distance] & (closer << 1) & open_left;
+            Bitboard right_steps = (cells[distance] << 1) & closer & open_left;
+
+            dag.up |= up_steps | down_steps;
+            dag.left |= left_steps | right_steps;
+            cells[distance - 1] = (up_steps >> width) | down_steps | (left_steps >> 1) | right_steps;
         }
 
-        next = Vector2(pos.x, pos.y + 1);
-        next_index = get_index(next);
-        if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-            !is_blocked(pos, next))
+        // Paths from pos to each cell, then from each cell to the goal
+        uint64_t from_start[MAX_CELLS];
+        uint64_t to_goal[MAX_CELLS];
+        DagStep steps[4];
+        from_start[get_index(pos)] = 1;
+        for (int distance = dag.distance - 1; distance >= 0; distance--)
         {
-            visited[next_index] = PathData(1, Direction::DOWN, is_unblockable(pos, next));
-            queue[write_index++] = next;
+            for (Bitboard next = cells[distance]; next != 0; next &= next - 1)
+            {
+                int index = get_bit_index(next & -next);
+                int step_count = get_dag_steps(dag, index, cells[distance + 1], steps);
+                from_start[index] = 0;
+                for (int i = 0; i < step_count; i++)
+                    from_start[index] += from_start[steps[i].cell];
+            }
         }
 
-        next = Vector2(pos.x - 1, pos.y);
-        next_index = get_index(next);
-        if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-            !is_blocked(pos, next))
+        for (Bitboard goal = cells[0]; goal != 0; goal &= goal - 1)
+            to_goal[get_bit_index(goal & -goal)] = 1;
+        for (int distance = 1; distance <= dag.distance; distance++)
         {
-            visited[next_index] = PathData(1, Direction::LEFT, is_unblockable(pos, next));
-            queue[write_index++] = next;
+            for (Bitboard next = cells[distance]; next != 0; next &= next - 1)
+            {
+                int index = get_bit_index(next & -next);
+                int step_count = get_dag_steps(dag, index, cells[distance - 1], steps);
+                to_goal[index] = 0;
+                for (int i = 0; i < step_count; i++)
+                {
+                    const DagStep &step = steps[i];
+                    uint64_t paths = from_start[index] * to_goal[step.cell];
+                    (step.is_up ? dag.up_paths : dag.left_paths)[step.edge] = paths;
+                    to_goal[index] += to_goal[step.cell];
+                }
+            }
         }
 
-        next = Vector2(pos.x + 1, pos.y);
-        next_index = get_index(next);
-        if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-            !is_blocked(pos, next))
+        dag.path_count = to_goal[get_index(pos)];
+        for (Bitboard edges = dag.up; edges != 0; edges &= edges - 1)
         {
-            visited[next_index] = PathData(1, Direction::RIGHT, is_unblockable(pos, next));
-            queue[write_index++] = next;
+            int edge = get_bit_index(edges & -edges);
+            if (dag.up_paths[edge] == dag.path_count)
+                dag.critical_up |= edges & -edges;
         }
-
-        while (write_index > read_index)
+        for (Bitboard edges = dag.left; edges != 0; edges &= edges - 1)
         {
-            int current_index = get_index(queue[read_index]);
-            Vector2 current = queue[read_index++];
-            PathData current_data = visited[current_index];
+            int edge = get_bit_index(edges & -edges);
+            if (dag.left_paths[edge] == dag.path_count)
+                dag.critical_left |= edges & -edges;
+        }
+    }
 
-            if (is_finished(current, dir))
-                return visited[get_index(current)];
+    // Slots whose wall may lengthen the shortest path from pos; every wall
+    // that does is one of them
+    Bitboard get_lengthening_slots(Vector2 pos, Direction dir)
+    {
+        ShortestPathDag dag;
+        compute_shortest_path_dag(pos, dir, dag);
 
-            int next_distance = current_data.distance + 1;
+        SlotThreats threats;
+        get_slot_threats(dag, threats);
+        return threats.lengthening;
+    }
 
-            Vector2 next = Vector2(current.x, current.y - 1);
-            int next_index = get_index(next);
-            if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-                !is_blocked(current, next))
-            {
-                bool unblockable = current_data.is_unblockable ? is_unblockable(current, next) : false;
-                visited[next_index] = PathData(next_distance, current_data.direction, unblockable);
-                queue[write_index++] = next;
-            }
+    // The threats of every slot at once. The masks are built over the cells
+    // the walls start from, with the DAG edges shifted onto them; only the
+    // walls with two non-critical edges on the DAG need their paths counted.
+    // The walls touching a path are the ones whose overlapping walls, one
+    // step before and after, cover one of its edges.
+    void get_slot_threats(const ShortestPathDag &dag, SlotThreats &threats)
+    {
+        Bitboard lengthening[2];
+        Bitboard touching[2];
+        for (int i = 0; i < 2; i++)
+        {
+            bool horizontal = i == 0;
+            Bitboard starts = horizontal ? horizontal_slots : vertical_slots;
+            Bitboard edges = horizontal ? dag.up : dag.left;
+            Bitboard critical = horizontal ? dag.critical_up : dag.critical_left;
+            const uint64_t *paths = horizontal ? dag.up_paths : dag.left_paths;
+            int step = horizontal ? 1 : (int)width;
 
-            next = Vector2(current.x, current.y + 1);
-            next_index = get_index(next);
-            if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-                !is_blocked(current, next))
+            lengthening[i] = starts & (critical | (critical >> step));
+            Bitboard pairs = starts & edges & (edges >> step) & ~lengthening[i];
+            for (; pairs != 0; pairs &= pairs - 1)
             {
-                bool unblockable = current_data.is_unblockable ? is_unblockable(current, next) : false;
-                visited[next_index] = PathData(next_distance, current_data.direction, unblockable);
-                queue[write_index++] = next;
+                int edge = get_bit_index(pairs & -pairs);
+                if (paths[edge] + paths[edge + step] >= dag.path_count)
+                    lengthening[i] |= pairs & -pairs;
             }
 
-            next = Vector2(current.x - 1, current.y);
-            next_index = get_index(next);
-            if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-                !is_blocked(current, next))
+            touching[i] = starts & (edges | (edges >> step) | ((edges << step) & (starts << step)) |
+                                    ((edges >> (2 * step)) & (starts >> step)));
+        }
+        threats.lengthening = get_slot_order(lengthening[0], lengthening[1]);
+        threats.touching = get_slot_order(touching[0], touching[1]);
+    }
+
+private:
+    Dimension<W> width;
+    Dimension<H> height;
+
+    // Edge of a ShortestPathDag from a cell to a neighbour in the given layer
+    struct DagStep
+    {
+        int cell;
+        bool is_up;
+        int edge;
+    };
+
+    // Moves masks over the cells horizontal and vertical walls start from
+    // into slot index order, with pext where the target has BMI2 and one row
+    // at a time otherwise
+    Bitboard get_slot_order(Bitboard horizontal, Bitboard vertical)
+    {
+        int row_width = width - 1;
+        int vertical_base = row_width * (height - 1);
+#ifdef __BMI2__
+        return extract_bits(horizontal, horizontal_slots) |
+               (extract_bits(vertical, vertical_slots) << vertical_base);
+#else
+        Bitboard row_mask = ((Bitboard)1 << row_width) - 1;
+
+        Bitboard slots = 0;
+        for (int y = 0; y + 1 < height; y++)
+        {
+            slots |= ((horizontal >> ((y + 1) * width)) & row_mask) << (y * row_width);
+            slots |= ((vertical >> (y * width + 1)) & row_mask) << (vertical_base + y * row_width);
+        }
+        return slots;
+#endif
+    }
+
+    int get_dag_steps(const ShortestPathDag &dag, int index, Bitboard layer, DagStep steps[4])
+    {
+        int count = 0;
+        int cell_count = width * height;
+        Bitboard bit = (Bitboard)1 << index;
+        if ((dag.up & bit) && (layer & (bit >> width)))
+            steps[count++] = {index - width, true, index};
+        if (index + width < cell_count && (dag.up & (bit << width)) && (layer & (bit << width)))
+            steps[count++] = {index + width, true, index + width};
+        if ((dag.left & bit) && (layer & (bit >> 1)))
+            steps[count++] = {index - 1, false, index};
+        if (index + 1 < cell_count && (dag.left & (bit << 1)) && (layer & (bit << 1)))
+            steps[count++] = {index + 1, false, index + 1};
+        return count;
+    }
+
+    int wall_count;
+    Bitboard blocked_up;
+    Bitboard blocked_left;
+    Bitboard placed_slots;
+    const WallSlotTable *slot_table;
+    WallSlotTable *owned_slot_table = nullptr;
+
+    // Board shape, fixed at construction
+    Bitboard up_edges;
+    Bitboard left_edges;
+    Bitboard horizontal_slots;
+    Bitboard vertical_slots;
+    Bitboard goal_masks[4];
+
+    // One distance field per goal direction, built on first use
+    DistanceField fields[4];
+    vector<FieldChange> journal;
+    vector<WallRecord> wall_records;
+
+    // Union-find over wall corners, without path compression so it can be undone
+    vector<int> chain_parent;
+    vector<int> chain_size;
+    vector<int> chain_history;
+
+    int find_chain(int corner)
+    {
+        while (chain_parent[corner] != corner)
+            corner = chain_parent[corner];
+        return corner;
+    }
+
+    void join_chains(int corner1, int corner2)
+    {
+        int root1 = find_chain(corner1);
+        int root2 = find_chain(corner2);
+        if (root1 == root2)
+            return;
+        if (chain_size[root1] < chain_size[root2])
+            swap(root1, root2);
+
+        chain_parent[root2] = root1;
+        chain_size[root1] += chain_size[root2];
+        chain_history.push_back(root2);
+    }
+
+    // Edges that a wall could still be placed on
+    Bitboard get_blockable_up()
+    {
+        Bitboard free_slots = horizontal_slots & ~blocked_up & ~(blocked_up >> 1);
+        return free_slots | (free_slots << 1);
+    }
+
+    Bitboard get_blockable_left()
+    {
+        Bitboard free_slots = vertical_slots & ~blocked_left & ~(blocked_left >> width);
+        return free_slots | (free_slots << width);
+    }
+
+    Bitboard expand(Bitboard cells, Bitboard open_up, Bitboard open_left)
+    {
+        return ((cells & open_up) >> width) | ((cells << width) & open_up) |
+               ((cells & open_left) >> 1) | ((cells << 1) & open_left);
+    }
+
+    Vector2 get_offset(Direction dir)
+    {
+        switch (dir)
+        {
+        case Direction::UP:
+            return Vector2(0, -1);
+        case Direction::DOWN:
+            return Vector2(0, 1);
+        case Direction::LEFT:
+            return Vector2(-1, 0);
+        case Direction::RIGHT:
+            return Vector2(1, 0);
+        }
+
+        return Vector2(0, 0);
+    }
+
+    // Reverse BFS from the goal edge, one layer of cells per iteration
+    void compute_distance_field(Direction dir, DistanceField &field)
+    {
+        fill_n(field.layers, MAX_CELLS, (Bitboard)0);
+
+        Bitboard open_up = up_edges & ~blocked_up;
+        Bitboard open_left = left_edges & ~blocked_left;
+
+        Bitboard frontier = goal_masks[(int)dir];
+        Bitboard visited = frontier;
+        for (int distance = 0; frontier != 0; distance++)
+        {
+            field.layers[distance] = frontier;
+
+            frontier = expand(frontier, open_up, open_left) & ~visited;
+            visited |= frontier;
+        }
+
+        field.is_valid = true;
+        field.is_safe_valid = false;
+        field.pending = 0;
+    }
+
+    void compute_safe_cells(DistanceField &field)
+    {
+        Bitboard open_up = up_edges & ~blocked_up;
+        Bitboard open_left = left_edges & ~blocked_left;
+        Bitboard safe_up = open_up & ~get_blockable_up();
+        Bitboard safe_left = open_left & ~get_blockable_left();
+
+        Bitboard safe = field.layers[0];
+        field.safe = safe;
+        for (int distance = 1; distance < MAX_CELLS && field.layers[distance] != 0; distance++)
+        {
+            safe = expand(safe, safe_up, safe_left) & field.layers[distance];
+            field.safe |= safe;
+        }
+
+        field.is_safe_valid = true;
+    }
+
+    // Walls only make distances grow, so the seeds of several walls can be
+    // repaired at once. First find the cells that lost every
+    // neighbour one step closer to the goal, layer by layer from the seeds,
+    // then settle those cells again from the unaffected ones around them.
+    // Every layer is journaled before its first change.
+    void repair_distance_field(int dir, Bitboard seeds)
+    {
+        DistanceField &field = fields[dir];
+        Bitboard open_up = up_edges & ~blocked_up;
+        Bitboard open_left = left_edges & ~blocked_left;
+
+        int first = field.get_distance(seeds & ~field.layers[0]);
+        if (first == UNREACHABLE)
+            return;
+
+        Bitboard journaled = 0;
+        Bitboard affected = 0;
+        Bitboard candidates = 0;
+        int first_affected = MAX_CELLS;
+        for (int distance = first; distance + 1 < MAX_CELLS; distance++)
+        {
+            candidates |= seeds & field.layers[distance];
+            if (candidates == 0)
             {
-                bool unblockable = current_data.is_unblockable ? is_unblockable(current, next) : false;
-                visited[next_index] = PathData(next_distance, current_data.direction, unblockable);
-                queue[write_index++] = next;
+                if (field.layers[distance] == 0)
+                    break;
+                continue;
             }
 
-            next = Vector2(current.x + 1, current.y);
-            next_index = get_index(next);
-            if (is_inside(next) && visited[next_index].distance == UNVISITED &&
-                !is_blocked(current, next))
+            Bitboard lost = candidates & ~expand(field.layers[distance - 1], open_up, open_left);
+            if (lost != 0)
             {
-                bool unblockable = current_data.is_unblockable ? is_unblockable(current, next) : false;
-                visited[next_index] = PathData(next_distance, current_data.direction, unblockable);
-                queue[write_index++] = next;
+                if (first_affected == MAX_CELLS)
+                    first_affected = distance;
+                journal_layer(dir, distance, journaled);
+                field.layers[distance] &= ~lost;
+                affected |= lost;
             }
+            candidates = expand(lost, open_up, open_left) & field.layers[distance + 1];
         }
 
-        return PathData(UNREACHABLE, dir, true);
+        Bitboard remaining = affected;
+        for (int distance = first_affected - 1;
+             remaining != 0 && field.layers[distance] != 0 && distance + 1 < MAX_CELLS; distance++)
+        {
+            Bitboard found = expand(field.layers[distance], open_up, open_left) & remaining;
+            if (found == 0)
+                continue;
+            remaining &= ~found;
+            journal_layer(dir, distance + 1, journaled);
+            field.layers[distance + 1] |= found;
+        }
     }
 
-private:
-    int width;
-    int height;
-    int *blocked_paths;
-    PathData *visited;
-    Vector2 *queue;
-    int write_index;
-    int read_index;
-
-    int wall_count;
-    void set_blocked(Vector2 pos1, Vector2 pos2, int blocked)
+    void journal_layer(int dir, int distance, Bitboard &journaled)
     {
-        // Exploit symmetry
-        blocked_paths[pos1.x + pos1.y * width + pos2.x * width * height +
-                      pos2.y * width * width * height] = blocked;
-        blocked_paths[pos2.x + pos2.y * width + pos1.x * width * height +
-                      pos1.y * width * width * height] = blocked;
+        Bitboard bit = (Bitboard)1 << distance;
+        if (journaled & bit)
+            return;
+        journaled |= bit;
+        journal.push_back({dir, distance, fields[dir].layers[distance]});
     }
 };
 
@@ -379,23 +1020,8 @@ enum class BoardState
     ILLEGAL
 };
 
-int compare_board_states(BoardState state1, BoardState state2)
-{
-    int state1_score = state1 == BoardState::WON ? 1
-                                                 : (state1 == BoardState::LOST ? -1
-                                                                               : 0);
-    int state2_score = state2 == BoardState::WON ? 1
-                                                 : (state2 == BoardState::LOST ? -1
-                                                                               : 0);
-    if (state1_score != state2_score)
-    {
-        if (state1_score > state2_score)
-            return 1;
-        else
-            return -1;
-    }
-    return 0;
-}
+// Rank of a board state in the search order: LOST < UNDECIDED, ILLEGAL < WON
+constexpr int STATE_RANKS[4] = {1, 2, 0, 1};
 
 struct Score
 {
@@ -403,61 +1029,32 @@ struct Score
     int depth;
     BoardState first_place_state;
     BoardState second_place_state;
+    // Packs the comparison order into one integer: first-place state, then
+    // second-place state (ignored once first place is WON), then score
+    int64_t key;
 
     Score() : Score(0, BoardState::UNDECIDED) {}
-    Score(int score, BoardState state)
-    {
-        this->score = score;
-        this->first_place_state = state;
-        this->second_place_state = state;
-    }
+    Score(int score, BoardState state) : Score(score, state, state) {}
 
     Score(int score, BoardState first_place_state, BoardState second_place_state)
     {
         this->score = score;
+        this->depth = 0;
         this->first_place_state = first_place_state;
         this->second_place_state = second_place_state;
-    }
-
-    bool operator<(const Score &other) const
-    {
-        int first_state_compare = compare_board_states(first_place_state,
-                                                       other.first_place_state);
 
-        if (first_state_compare != 0)
-            return first_state_compare < 0;
-
-        if (first_place_state != BoardState::WON)
-        {
-            int second_state_compare = compare_board_states(second_place_state,
-                                                            other.second_place_state);
-
-            if (second_state_compare != 0)
-                return second_state_compare < 0;
-        }
-
-        return score < other.score;
+        int first_rank = STATE_RANKS[(int)first_place_state];
+        int second_rank = first_place_state == BoardState::WON ? 1 : STATE_RANKS[(int)second_place_state];
+        this->key = ((int64_t)(first_rank * 3 + second_rank) << 32) + score;
     }
 
-    bool operator>(const Score &other) const
-    {
-        int first_state_compare = compare_board_states(first_place_state,
-                                                       other.first_place_state);
+    // Neighbouring scores in key order, used as null-window bounds
+    Score get_next() const { return Score(score + 1, first_place_state, second_place_state); }
+    Score get_previous() const { return Score(score - 1, first_place_state, second_place_state); }
 
-        if (first_state_compare != 0)
-            return first_state_compare > 0;
+    bool operator<(const Score &other) const { return key < other.key; }
 
-        if (first_place_state != BoardState::WON)
-        {
-            int second_state_compare = compare_board_states(second_place_state,
-                                                            other.second_place_state);
-
-            if (second_state_compare != 0)
-                return second_state_compare > 0;
-        }
-
-        return score > other.score;
-    }
+    bool operator>(const Score &other) const { return key > other.key; }
 
     bool operator==(const Score &other) const
     {
@@ -465,15 +1062,9 @@ struct Score
                second_place_state == other.second_place_state;
     }
 
-    bool operator<=(const Score &other) const
-    {
-        return *this < other || *this == other;
-    }
+    bool operator<=(const Score &other) const { return key <= other.key; }
 
-    bool operator>=(const Score &other) const
-    {
-        return *this > other || *this == other;
-    }
+    bool operator>=(const Score &other) const { return key >= other.key; }
 };
 
 Score max(Score score1, Score score2)
@@ -490,93 +1081,25 @@ Score min(Score score1, Score score2)
     return score2;
 }
 
-struct Move
-{
-    Score score;
-    bool is_wall;
-    Wall wall;
-    int id;
-    Vector2 direction;
-    Move() : Move(0, Vector2(0, 0)) {}
-    Move(int id, Vector2 direction)
-    {
-        this->is_wall = false;
-        this->id = id;
-        this->direction = direction;
-    }
-    Move(int id, Wall wall)
-    {
-        this->is_wall = true;
-        this->id = id;
-        this->wall = wall;
-    }
-};
-
-class MinMovesArray
-{
-public:
-    MinMovesArray(int _size)
-    {
-        this->_size = _size;
-        this->moves = new Move[_size];
-        this->num_elements = 0;
-        this->max_score = Score(-999999, BoardState::LOST);
-        this->max_index = 0;
-    }
-
-    ~MinMovesArray() { delete[] moves; }
-
-    int size() { return num_elements; }
-
-    void push(Move move)
-    {
-        if (move.score.first_place_state == BoardState::ILLEGAL || move.score.second_place_state == BoardState::ILLEGAL)
-            return;
-
-        if (num_elements < _size)
-        {
-            moves[num_elements++] = move;
-            if (move.score > max_score)
-            {
-                max_score = move.score;
-                max_index = num_elements - 1;
-            }
-            return;
-        }
-
-        if (move.score < max_score)
-        {
-            moves[max_index] = move;
-            update_max();
-        }
-    }
-
-    Move get(int index) { return moves[index]; }
-    void sort()
+struct Move
+{
+    Score score;
+    bool is_wall;
+    Wall wall;
+    int id;
+    Vector2 direction;
+    Move() : Move(0, Vector2(0, 0)) {}
+    Move(int id, Vector2 direction)
     {
-        std::sort(moves, moves + num_elements,
-                  [](const Move &a, const Move &b)
-                  { return a.score < b.score; });
+        this->is_wall = false;
+        this->id = id;
+        this->direction = direction;
     }
-
-private:
-    int _size;
-    Move *moves;
-    int num_elements;
-    Score max_score;
-    int max_index;
-
-    void update_max()
+    Move(int id, Wall wall)
     {
-        max_score = Score(-999999, BoardState::LOST);
-        for (int i = 0; i < num_elements; i++)
-        {
-            if (moves[i].score > max_score)
-            {
-                max_score = moves[i].score;
-                max_index = i;
-            }
-        }
+        this->is_wall = true;
+        this->id = id;
+        this->wall = wall;
     }
 };
 
@@ -630,6 +1153,12 @@ public:
                   { return a.score > b.score; });
     }
 
+    // Search moves[index] first, keeping the order of the rest
+    void move_to_front(int index)
+    {
+        std::rotate(moves, moves + index, moves + index + 1);
+    }
+
 private:
     int _size;
     Move *moves;
@@ -651,6 +1180,201 @@ private:
     }
 };
 
+// Stages of Board::MoveGenerator, in the order they are handed out
+enum class GeneratorStage
+{
+    TABLE,
+    PAWN,
+    KILLERS,
+    PATH_WALLS,
+    OTHER_WALLS,
+    DONE
+};
+
+enum class Bound : uint8_t
+{
+    EXACT,
+    LOWER,
+    UPPER
+};
+
+// Which search picks the moves, chosen per player count on the command line
+enum class SearchEngine
+{
+    ALPHA_BETA, // iterative deepening principal variation search
+    MONTE_CARLO // UCT with progressive widening over the walls
+};
+
+// How extra search threads share the work
+enum class ParallelSearch
+{
+    LAZY_SMP,           // each one runs its own iterative deepening
+    YOUNG_BROTHERS_WAIT // they take the younger siblings at split points
+};
+
+// How the opponents are modelled while three players are in play
+enum class MultiPlayerSearch
+{
+    PARANOID,  // both minimize our score, with alpha-beta pruning
+    MAX_N,     // each maximizes its own score, without pruning
+    BEST_REPLY // only the strongest reply of either opponent, then our turn again
+};
+
+#define NO_MOVE -1
+
+// The data of one entry, packed into a single word. The side to move is part
+// of the hash, so the best move is stored as a wall slot, or MAX_SLOTS +
+// direction for pawn moves.
+struct TranspositionEntry
+{
+    int16_t score;
+    uint8_t states; // first place state in the low nibble, second place in the high
+    int8_t depth;
+    int16_t move;
+    Bound bound;
+    uint8_t age;
+
+    Score get_score()
+    {
+        return Score(score, (BoardState)(states & 15), (BoardState)(states >> 4));
+    }
+};
+
+static_assert(sizeof(TranspositionEntry) == sizeof(uint64_t), "entry data must fit one word");
+
+// 16 bytes, four to a cache line. Search threads share the table without
+// locks: the key is stored xor the data, so a slot torn by two writers fails
+// the key check instead of handing out a mix of both entries.
+struct TranspositionSlot
+{
+    atomic<uint64_t> check;
+    atomic<uint64_t> data;
+};
+
+struct alignas(64) TranspositionBucket
+{
+    TranspositionSlot slots[4];
+};
+
+class TranspositionTable
+{
+public:
+    TranspositionTable(int size_mb)
+    {
+        bucket_count = 1;
+        while (bucket_count * 2 * sizeof(TranspositionBucket) <= (size_t)size_mb << 20)
+            bucket_count *= 2;
+        buckets = new TranspositionBucket[bucket_count]();
+        age = 0;
+    }
+    ~TranspositionTable() { delete[] buckets; }
+
+    // Entries from earlier searches only keep their best move for ordering
+    void new_search() { age++; }
+
+    uint8_t get_age() { return age; }
+
+    bool probe(uint64_t key, TranspositionEntry &entry)
+    {
+        TranspositionBucket &bucket = buckets[key & (bucket_count - 1)];
+        for (TranspositionSlot &slot : bucket.slots)
+        {
+            uint64_t data = slot.data.load(memory_order_relaxed);
+            if ((slot.check.load(memory_order_relaxed) ^ data) == key)
+            {
+                memcpy(&entry, &data, sizeof(entry));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void store(uint64_t key, Score score, int depth, Bound bound, int16_t move)
+    {
+        if (score.score < INT16_MIN || score.score > INT16_MAX)
+            return;
+
+        // Replace the same position, else the shallowest entry, preferring old ones
+        TranspositionBucket &bucket = buckets[key & (bucket_count - 1)];
+        TranspositionSlot *replace = &bucket.slots[0];
+        int replace_value = INT32_MAX;
+        for (TranspositionSlot &slot : bucket.slots)
+        {
+            uint64_t data = slot.data.load(memory_order_relaxed);
+            TranspositionEntry entry;
+            memcpy(&entry, &data, sizeof(entry));
+            if ((slot.check.load(memory_order_relaxed) ^ data) == key)
+            {
+                if (entry.age == age && entry.depth > depth && bound != Bound::EXACT)
+                    return;
+                replace = &slot;
+                break;
+            }
+
+            int value = entry.depth - (entry.age != age ? 256 : 0);
+            if (value < replace_value)
+            {
+                replace = &slot;
+                replace_value = value;
+            }
+        }
+
+        TranspositionEntry entry;
+        entry.score = score.score;
+        entry.states = (uint8_t)score.first_place_state | ((uint8_t)score.second_place_state << 4);
+        entry.depth = depth;
+        entry.move = move;
+        entry.bound = bound;
+        entry.age = age;
+
+        uint64_t data;
+        memcpy(&data, &entry, sizeof(data));
+        replace->data.store(data, memory_order_relaxed);
+        replace->check.store(key ^ data, memory_order_relaxed);
+    }
+
+private:
+    TranspositionBucket *buckets;
+    size_t bucket_count;
+    uint8_t age;
+};
+
+#define TRANSPOSITION_TABLE_MB 8
+#define MAX_SEARCH_DEPTH 32
+#define SEARCH_THREADS 1
+#define PARALLEL_SEARCH ParallelSearch::YOUNG_BROTHERS_WAIT
+// Nodes closer to the horizon are not worth handing to another thread
+#define MIN_SPLIT_DEPTH 3
+
+#define MULTI_PLAYER_SEARCH MultiPlayerSearch::BEST_REPLY
+// Two player positions with at most PROOF_MAX_WALLS walls in play get a
+// proof-number search within a share of the turn before the heuristic one
+#define PROOF_MAX_WALLS 4
+#define PROOF_TIME_PERCENT 30
+#define PROOF_MAX_NODES 200000
+#define PROOF_TABLE_SIZE (1 << 16) // must be a power of two
+#define PROOF_INFINITY (1u << 30)
+
+#define DEFAULT_ENGINE_2P SearchEngine::ALPHA_BETA
+#define DEFAULT_ENGINE_3P SearchEngine::ALPHA_BETA
+#define MCTS_MAX_NODES 200000
+#define MCTS_MAX_WALLS 8 // best scored walls a node may try besides its pawn move
+#define MCTS_EXPLORATION 0.7
+#define MCTS_WIDENING 1.0 // a node opens 1 + MCTS_WIDENING * sqrt(visits) children
+#define MCTS_WALL_PERCENT 30
+#define MCTS_PLAYOUT_PLIES 40
+#define ASPIRATION_WINDOW 2
+// Time a turn may use; stays under the 100 ms the referee allows, with room
+// for input, output and the last node that overruns the deadline
+#define TURN_TIME_MICROS 80000
+// Plies from the search root that keep their own killer moves
+#define MAX_PLY 128
+#define NUM_KILLERS 2
+// Upper bound on the walls a MoveGenerator hands out at one node
+#define MAX_STAGED_WALLS 4
+// Walls are encoded by slot and pawn moves by MAX_SLOTS + Direction
+#define MAX_ENCODED_MOVES (MAX_SLOTS + 4)
+
 struct Player
 {
     bool is_alive;
@@ -670,6 +1394,74 @@ struct Player
     }
 };
 
+// A node whose younger children are open to idle search threads once the
+// eldest is searched. It lives on the stack of the thread that owns the node,
+// which only returns once every helper has left.
+struct SplitPoint
+{
+    SplitPoint *parent; // stopping the parent stops this one too
+    Move path[MAX_PLY]; // moves from the root to the node
+    int path_length;
+    int depth;
+    int breadth;
+    int id;
+    bool is_maximizing;
+
+    // Guarded by the lock
+    mutex lock;
+    Move moves[MAX_STAGED_WALLS + 1];
+    int move_count;
+    int next_move;
+    Score alpha;
+    Score beta;
+    Score best_score;
+    int16_t best_move;
+    bool is_cutoff;
+
+    atomic<int> helper_count;
+    atomic<bool> is_stopped;
+};
+
+// One node of the Monte Carlo tree. The children of a node are allocated
+// together, best prior first, when it is expanded, and opened one at a time
+// as its visits grow.
+struct MctsNode
+{
+    int16_t move; // encoded move that led here
+    int8_t mover; // player who made it
+    int first_child;
+    int child_count;
+    int visits;
+    float reward; // summed over the visits, for the mover
+};
+
+// Proof and disproof numbers of one position for the side to move
+struct ProofNumbers
+{
+    uint32_t phi = 1;   // proof number: leaves still to solve to prove a win, 0 once proven
+    uint32_t delta = 1; // disproof number: the same to prove a loss, 0 once proven
+};
+
+struct ProofEntry
+{
+    uint64_t key = 0;
+    int8_t attacker = -1; // player the proof is for
+    ProofNumbers numbers;
+};
+
+// Open split points and the helper threads waiting for one
+struct SearchPool
+{
+    mutex lock;
+    condition_variable wake;
+    vector<SplitPoint *> splits;
+    atomic<int> idle_count;
+    bool is_closed;
+
+    SearchPool() : idle_count(0), is_closed(false) {}
+};
+
+template <int W = 0, int H = 0, int P = 0>
 class Board
 {
 public:
@@ -678,7 +1470,7 @@ public:
 
         this->width = width;
         this->height = height;
-        this->grid = new WallGrid(width, height);
+        this->grid = new WallGrid<W, H>(width, height);
 
         player_count = clamp(player_count, 2, 3);
         this->player_count = player_count;
@@ -687,16 +1479,101 @@ public:
         this->players[1] = Player(Direction::LEFT);
         if (player_count == 3)
             this->players[2] = Player(Direction::DOWN);
+
+        this->table = new TranspositionTable(TRANSPOSITION_TABLE_MB);
+        this->owns_table = true;
+        std::fill(&history[0][0], &history[0][0] + MAX_PLAYERS * MAX_ENCODED_MOVES, 0);
+        new_search_ordering();
+    }
+    // The same position for a search thread: its own grid, players and move
+    // ordering, sharing the transposition table of other
+    Board(Board &other, int thread_index)
+    {
+        this->width = other.width;
+        this->height = other.height;
+        this->grid = new WallGrid<W, H>(width, height);
+        for (Bitboard slots = other.grid->get_placed_slots(); slots != 0; slots &= slots - 1)
+            grid->place_wall(grid->get_slot_wall(get_bit_index(slots & -slots)));
+
+        this->player_count = other.player_count;
+        this->players = new Player[player_count];
+        std::copy(other.players, other.players + player_count, players);
+
+        this->table = other.table;
+        this->owns_table = false;
+        this->thread_index = thread_index;
+        this->multi_player_search = other.multi_player_search;
+        std::copy(&other.history[0][0], &other.history[0][0] + MAX_PLAYERS * MAX_ENCODED_MOVES, &history[0][0]);
+        new_search_ordering();
+    }
+    ~Board()
+    {
+        delete grid;
+        delete[] players;
+        if (owns_table)
+            delete table;
     }
-    ~Board() { delete grid; }
 
     void move_player(int id, Vector2 direction)
     {
         if (id < 0 || id >= player_count)
             return;
 
+        hash ^= get_pawn_key(id);
         players[id].pos = players[id].pos + direction;
-        players[id].is_finished = player_is_at_end(id);
+        hash ^= get_pawn_key(id);
+
+        bool is_finished = player_is_at_end(id);
+        if (players[id].is_finished != is_finished)
+            hash ^= ZOBRIST.finished[id];
+        players[id].is_finished = is_finished;
+    }
+
+    void set_alive(int id, bool is_alive)
+    {
+        if (players[id].is_alive != is_alive)
+            hash ^= ZOBRIST.alive[id];
+        players[id].is_alive = is_alive;
+    }
+
+    void set_walls_left(int id, int walls_left)
+    {
+        hash ^= get_walls_left_key(id);
+        players[id].walls_left = walls_left;
+        hash ^= get_walls_left_key(id);
+    }
+
+    void set_side_to_move(int id)
+    {
+        hash ^= ZOBRIST.side_to_move[side_to_move] ^ ZOBRIST.side_to_move[id];
+        side_to_move = id;
+    }
+
+    // Hash of the walls, pawns, walls left, player flags and side to move.
+    // do_move and undo_move keep it up to date.
+    uint64_t get_hash() { return hash; }
+
+    // Rebuild the hash after the position was set up from the game input
+    void reset_hash(int side_to_move)
+    {
+        this->side_to_move = side_to_move;
+        hash = compute_hash();
+    }
+
+    uint64_t compute_hash()
+    {
+        uint64_t hash = ZOBRIST.side_to_move[side_to_move];
+        for (Bitboard slots = grid->get_placed_slots(); slots != 0; slots &= slots - 1)
+            hash ^= ZOBRIST.walls[get_bit_index(slots)];
+        for (int i = 0; i < player_count; i++)
+        {
+            hash ^= get_pawn_key(i) ^ get_walls_left_key(i);
+            if (players[i].is_alive)
+                hash ^= ZOBRIST.alive[i];
+            if (players[i].is_finished)
+                hash ^= ZOBRIST.finished[i];
+        }
+        return hash;
     }
 
     void update_player(int id, Vector2 pos, int walls_left)
@@ -718,9 +1595,7 @@ public:
     {
         for (int i = 0; i < player_count; i++)
         {
-            if (players[i].is_alive &&
-                grid->get_path_data(players[i].pos, players[i].end_direction).distance ==
-                    UNREACHABLE)
+            if (players[i].is_alive && get_path_data(i).distance == UNREACHABLE)
                 return false;
         }
 
@@ -766,62 +1641,8 @@ public:
 
     bool is_overlaping(Wall wall)
     {
-        // check if wall overlaps with another wall
-        if (wall.horizontal)
-        {
-            if (grid->is_blocked(wall.pos, wall.pos + Vector2(0, -1)) ||
-                grid->is_blocked(wall.pos + Vector2(1, 0), wall.pos + Vector2(1, -1)))
-                return true;
-
-            if (grid->get_blocked(wall.pos, wall.pos + Vector2(1, 0)) ==
-                    grid->get_blocked(wall.pos + Vector2(0, -1),
-                                      wall.pos + Vector2(1, -1)) &&
-                grid->is_blocked(wall.pos, wall.pos + Vector2(1, 0)))
-                return true;
-        }
-        else
-        {
-            if (grid->is_blocked(wall.pos, wall.pos + Vector2(-1, 0)) ||
-                grid->is_blocked(wall.pos + Vector2(0, 1), wall.pos + Vector2(-1, 1)))
-                return true;
-
-            if (grid->get_blocked(wall.pos, wall.pos + Vector2(0, 1)) ==
-                    grid->get_blocked(wall.pos + Vector2(-1, 0),
-                                      wall.pos + Vector2(-1, 1)) &&
-                grid->is_blocked(wall.pos, wall.pos + Vector2(0, 1)))
-                return true;
-        }
-
-        return false;
-    }
-
-    bool is_wall_distance(Wall wall, int distance)
-    {
-        if (players[0].is_alive)
-        {
-            int distance_1 = abs(wall.pos.x - players[0].pos.x) +
-                             abs(wall.pos.y - players[0].pos.y);
-            if (distance_1 <= distance)
-                return true;
-        }
-
-        if (players[1].is_alive)
-        {
-            int distance_2 = abs(wall.pos.x - players[1].pos.x) +
-                             abs(wall.pos.y - players[1].pos.y);
-            if (distance_2 <= distance)
-                return true;
-        }
-
-        if (player_count == 3 && players[2].is_alive)
-        {
-            int distance_3 = abs(wall.pos.x - players[2].pos.x) +
-                             abs(wall.pos.y - players[2].pos.y);
-            if (distance_3 <= distance)
-                return true;
-        }
-
-        return false;
+        // check if wall overlaps or crosses another wall
+        return grid->is_conflicting(wall);
     }
 
     bool can_place_wall(Wall wall)
@@ -830,17 +1651,15 @@ public:
         if (is_overlaping(wall))
             return false;
 
-        // Make sure there is a path for each player
-
-        if (grid->get_wall_count() != 0)
-        {
-            place_wall(wall);
-            bool allowed = can_finish();
-            remove_wall(wall);
-            return allowed;
-        }
+        // A wall that closes no loop can not cut anyone off
+        if (!grid->closes_chain(wall))
+            return true;
 
-        return true;
+        // Make sure there is a path for each player
+        place_wall(wall);
+        bool allowed = can_finish();
+        remove_wall(wall);
+        return allowed;
     }
 
     void place_wall(Wall wall)
@@ -858,15 +1677,19 @@ public:
         if (move.is_wall)
         {
             temp_wall_count++;
-            players[move.id].walls_left--;
+            set_walls_left(move.id, players[move.id].walls_left - 1);
             place_wall(move.wall);
+            hash ^= ZOBRIST.walls[grid->get_slot_index(move.wall)];
         }
         else
         {
             move_player(move.id, move.direction);
         }
 
+        if (turn_count < MAX_PLY)
+            path[turn_count] = move;
         turn_count++;
+        set_side_to_move(get_next_id(move.id));
     }
 
     void undo_move(Move move)
@@ -874,8 +1697,9 @@ public:
         if (move.is_wall)
         {
             temp_wall_count--;
-            players[move.id].walls_left++;
+            set_walls_left(move.id, players[move.id].walls_left + 1);
             remove_wall(move.wall);
+            hash ^= ZOBRIST.walls[grid->get_slot_index(move.wall)];
         }
         else
         {
@@ -883,12 +1707,17 @@ public:
         }
 
         turn_count--;
+        set_side_to_move(move.id);
     }
 
     Move get_best_direction(int id)
     {
         Vector2 pos = players[id].pos;
-        Direction dir = grid->get_path_data(pos, players[id].end_direction).direction;
+        return get_step(id, grid->get_path_data(pos, players[id].end_direction).direction);
+    }
+
+    Move get_step(int id, Direction dir)
+    {
         switch (dir)
         {
         case Direction::UP:
@@ -904,74 +1733,188 @@ public:
         return Move(id, Vector2(0, 0));
     }
 
-    // lost is best
-    MinMovesArray *get_minimizing_moves(int my_id, int current_id, int breadth,
-                                        bool use_walls)
-    {
-        Move direction = get_best_direction(current_id);
-        direction.score = score_move(my_id, direction);
-        int distance = grid->get_path_data(players[current_id].pos,
-                                           players[current_id].end_direction)
-                           .distance;
-        if (distance <= 1 || (direction.score.first_place_state == BoardState::LOST && direction.score.second_place_state == BoardState::LOST) || !use_walls)
-        {
-            MinMovesArray *single_move = new MinMovesArray(1);
-            single_move->push(direction);
-            return single_move;
+    // Hands out the children of a search node one at a time: the
+    // transposition table move, the pawn move, the killer walls, the walls
+    // that may lengthen an opponent's shortest path and then the remaining
+    // walls. A stage is only generated and scored once the search asks for a
+    // move past the previous one, so a cutoff on an early move skips the
+    // wall scoring. At most breadth - 1 walls are handed out next to the pawn
+    // move.
+    class MoveGenerator
+    {
+    public:
+        MoveGenerator(Board *board, int my_id, int current_id, int breadth, bool use_walls,
+                      int16_t table_move, bool is_maximizing)
+        {
+            this->board = board;
+            this->my_id = my_id;
+            this->current_id = current_id;
+            this->table_move = table_move;
+            this->is_maximizing = is_maximizing;
+            this->stage = GeneratorStage::TABLE;
+            this->wall_budget = std::clamp(breadth - 1, 1, MAX_STAGED_WALLS);
+            this->handed_out = 0;
+            this->selected_count = 0;
+            this->selected_index = 0;
+
+            pawn_move = board->get_best_direction(current_id);
+            pawn_move.score = board->score_move(my_id, pawn_move);
+
+            // A decided pawn move or a turn without walls leaves nothing to choose
+            bool is_single;
+            if (is_maximizing)
+                is_single = is_decisive(pawn_move.score);
+            else
+                is_single = is_decisive(pawn_move.score) ||
+                            board->get_path_data(current_id).distance <= 1;
+            has_walls = !is_single && use_walls && board->players[current_id].walls_left != 0;
+            if (!has_walls)
+                stage = GeneratorStage::PAWN;
         }
 
-        MinMovesArray *moves = new MinMovesArray(breadth);
-        moves->push(direction);
-
-        if (players[current_id].walls_left != 0)
+        bool next(Move &move)
         {
-            // Horizontal walls
-            for (int y = 1; y < height; y++)
+            while (true)
             {
-                for (int x = 0; x < width - 1; x++)
+                if (selected_index < selected_count)
                 {
-                    Wall wall = Wall(Vector2(x, y), true);
-                    if (!is_overlaping(wall) && is_wall_distance(wall, 3))
+                    move = selected[selected_index++];
+                    return true;
+                }
+
+                switch (stage)
+                {
+                case GeneratorStage::TABLE:
+                    stage = GeneratorStage::PAWN;
+                    select_walls(get_slot_bit(table_move));
+                    break;
+                case GeneratorStage::PAWN:
+                    stage = has_walls && wall_budget > 0 ? GeneratorStage::KILLERS : GeneratorStage::DONE;
+                    if (!is_illegal(pawn_move.score))
                     {
-                        Move wall_move = Move(current_id, wall);
-                        wall_move.score = score_move(my_id, wall_move);
-                        if (wall_move.score.first_place_state == BoardState::LOST && wall_move.score.second_place_state == BoardState::LOST)
-                        {
-                            MinMovesArray *single_move = new MinMovesArray(1);
-                            single_move->push(wall_move);
-                            delete moves;
-                            return single_move;
-                        }
-                        moves->push(wall_move);
+                        move = pawn_move;
+                        return true;
                     }
+                    break;
+                case GeneratorStage::KILLERS:
+                {
+                    stage = GeneratorStage::PATH_WALLS;
+                    Bitboard killers = 0;
+                    int16_t *ply_killers = board->get_killers();
+                    for (int i = 0; i < NUM_KILLERS; i++)
+                        killers |= get_slot_bit(ply_killers[i]);
+                    select_walls(killers);
+                    break;
+                }
+                case GeneratorStage::PATH_WALLS:
+                {
+                    stage = GeneratorStage::OTHER_WALLS;
+                    Bitboard path_slots = 0;
+                    for (int id = 0; id < board->player_count; id++)
+                        if (id != current_id && board->players[id].is_alive)
+                            path_slots |= board->grid->get_lengthening_slots(board->players[id].pos,
+                                                                              board->players[id].end_direction);
+                    select_walls(path_slots);
+                    break;
+                }
+                case GeneratorStage::OTHER_WALLS:
+                    stage = GeneratorStage::DONE;
+                    select_walls(board->grid->get_all_slots());
+                    break;
+                case GeneratorStage::DONE:
+                    return false;
                 }
             }
+        }
+
+    private:
+        Board *board;
+        int my_id;
+        int current_id;
+        int16_t table_move;
+        bool is_maximizing;
+        GeneratorStage stage;
+        bool has_walls;
+        int wall_budget;
+        Bitboard handed_out;
+        Move pawn_move;
+        Move selected[MAX_STAGED_WALLS];
+        int selected_count;
+        int selected_index;
+
+        bool is_decisive(const Score &score)
+        {
+            if (is_maximizing)
+                return score.first_place_state == BoardState::WON && score.second_place_state == BoardState::WON;
+            return score.first_place_state == BoardState::LOST && score.second_place_state == BoardState::LOST;
+        }
+
+        bool is_illegal(const Score &score)
+        {
+            return score.first_place_state == BoardState::ILLEGAL || score.second_place_state == BoardState::ILLEGAL;
+        }
+
+        bool is_better(const Score &a, const Score &b) { return is_maximizing ? a > b : a < b; }
+
+        // Better static score first, ties go to the move with more history
+        bool is_ahead(const Move &a, const Move &b)
+        {
+            if (a.score.key != b.score.key)
+                return is_better(a.score, b.score);
+            return board->history[a.id][board->encode_move(a)] > board->history[b.id][board->encode_move(b)];
+        }
+
+        // Bit of an encoded move if it is a wall of this board
+        Bitboard get_slot_bit(int16_t encoded)
+        {
+            if (encoded < 0 || encoded >= board->grid->get_slot_count())
+                return 0;
+            return (Bitboard)1 << encoded;
+        }
+
+        // Scores the walls of the given slots that were not handed out yet and
+        // keeps the best ones within the wall budget. A decisive wall is handed
+        // out alone and ends the generation.
+        void select_walls(Bitboard slots)
+        {
+            selected_count = 0;
+            selected_index = 0;
+            if (wall_budget == 0)
+                return;
 
-            // Vertical walls
-            for (int y = 0; y < height - 1; y++)
+            Move scored[MAX_SLOTS];
+            int scored_count = board->score_walls(my_id, current_id, slots & ~handed_out, scored);
+            for (int j = 0; j < scored_count; j++)
             {
-                for (int x = 1; x < width; x++)
+                const Move &wall_move = scored[j];
+                if (is_illegal(wall_move.score))
+                    continue;
+                if (is_decisive(wall_move.score))
                 {
-                    Wall wall = Wall(Vector2(x, y), false);
-                    if (!is_overlaping(wall) && is_wall_distance(wall, 3))
-                    {
-                        Move wall_move = Move(current_id, wall);
-                        wall_move.score = score_move(my_id, wall_move);
-                        if (wall_move.score.first_place_state == BoardState::LOST && wall_move.score.second_place_state == BoardState::LOST)
-                        {
-                            MinMovesArray *single_move = new MinMovesArray(1);
-                            single_move->push(wall_move);
-                            delete moves;
-                            return single_move;
-                        }
-                    }
+                    selected[0] = wall_move;
+                    selected_count = 1;
+                    stage = GeneratorStage::DONE;
+                    return;
                 }
+
+                // Insert into the best walls so far
+                int i;
+                if (selected_count < wall_budget)
+                    i = selected_count++;
+                else if (is_ahead(wall_move, selected[selected_count - 1]))
+                    i = selected_count - 1;
+                else
+                    continue;
+                for (; i > 0 && is_ahead(wall_move, selected[i - 1]); i--)
+                    selected[i] = selected[i - 1];
+                selected[i] = wall_move;
             }
-        }
 
-        moves->sort();
-        return moves;
-    }
+            for (int i = 0; i < selected_count; i++)
+                handed_out |= get_slot_bit(board->grid->get_slot_index(selected[i].wall));
+            wall_budget -= selected_count;
+        }
+    };
 
     // won is best
     MaxMovesArray *get_maximizing_moves(int my_id, int current_id, int breadth,
@@ -992,47 +1935,29 @@ public:
 
         if (players[current_id].walls_left != 0)
         {
-            // Horizontal walls
-            for (int y = 1; y < height; y++)
-            {
-                for (int x = 0; x < width - 1; x++)
-                {
-                    Wall wall = Wall(Vector2(x, y), true);
-                    if (!is_overlaping(wall) && is_wall_distance(wall, 3))
-                    {
-                        Move wall_move = Move(current_id, wall);
-                        wall_move.score = score_move(my_id, wall_move);
-                        if (wall_move.score.first_place_state == BoardState::WON && wall_move.score.second_place_state == BoardState::WON)
-                        {
-                            MaxMovesArray *single_move = new MaxMovesArray(1);
-                            single_move->push(wall_move);
-                            delete moves;
-                            return single_move;
-                        }
-                        moves->push(wall_move);
-                    }
-                }
-            }
+            // Walls that can not lengthen an opponent's path are only scored
+            // when the others leave room in the list
+            Bitboard threatening = 0;
+            for (int id = 0; id < player_count; id++)
+                if (id != current_id && players[id].is_alive)
+                    threatening |= grid->get_lengthening_slots(players[id].pos, players[id].end_direction);
 
-            // Vertical walls
-            for (int y = 0; y < height - 1; y++)
+            Bitboard stages[2] = {threatening, grid->get_all_slots() & ~threatening};
+            for (int stage = 0; stage < 2 && moves->size() < breadth; stage++)
             {
-                for (int x = 1; x < width; x++)
+                Move scored[MAX_SLOTS];
+                int scored_count = score_walls(my_id, current_id, stages[stage], scored);
+                for (int i = 0; i < scored_count; i++)
                 {
-                    Wall wall = Wall(Vector2(x, y), false);
-                    if (!is_overlaping(wall) && is_wall_distance(wall, 3))
+                    const Move &wall_move = scored[i];
+                    if (wall_move.score.first_place_state == BoardState::WON && wall_move.score.second_place_state == BoardState::WON)
                     {
-                        Move wall_move = Move(current_id, wall);
-                        wall_move.score = score_move(my_id, wall_move);
-                        if (wall_move.score.first_place_state == BoardState::WON && wall_move.score.second_place_state == BoardState::WON)
-                        {
-                            MaxMovesArray *single_move = new MaxMovesArray(1);
-                            single_move->push(wall_move);
-                            delete moves;
-                            return single_move;
-                        }
-                        moves->push(wall_move);
+                        MaxMovesArray *single_move = new MaxMovesArray(1);
+                        single_move->push(wall_move);
+                        delete moves;
+                        return single_move;
                     }
+                    moves->push(wall_move);
                 }
             }
         }
@@ -1043,14 +1968,62 @@ public:
 
     int get_distance(int id)
     {
-        return grid->get_path_data(players[id].pos, players[id].end_direction).distance;
+        return get_path_data(id).distance;
     }
 
     PathData get_path_data(int id)
     {
+        if ((kept_paths_mask >> id) & 1)
+            return kept_paths[id];
         return grid->get_path_data(players[id].pos, players[id].end_direction);
     }
 
+    // Scores every placeable wall of the given slots for the current player,
+    // in slot order, and returns how many were written to moves. The threats
+    // of every slot to each player's shortest paths are found once for the
+    // whole batch. While a wall that keeps a player's path data is placed and
+    // scored, that data is reused, so the player's distance field is never
+    // repaired for it; only the players whose paths the wall may change pay
+    // for a search. An unblockable first step keeps its safe route, so such a
+    // path only needs its length kept. Any other path also needs every edge
+    // to stay open and blockable.
+    int score_walls(int my_id, int current_id, Bitboard slots, Move *moves)
+    {
+        if (slots == 0)
+            return 0;
+
+        Bitboard kept_slots[MAX_PLAYERS];
+        for (int id = 0; id < player_count; id++)
+        {
+            ShortestPathDag dag;
+            SlotThreats threats;
+            kept_paths[id] = get_path_data(id);
+            grid->compute_shortest_path_dag(players[id].pos, players[id].end_direction, dag);
+            grid->get_slot_threats(dag, threats);
+            kept_slots[id] = ~(kept_paths[id].is_unblockable ? threats.lengthening : threats.touching);
+        }
+
+        int count = 0;
+        for (; slots != 0 && !is_out_of_time(); slots &= slots - 1)
+        {
+            int slot = get_bit_index(slots & -slots);
+            kept_paths_mask = 0;
+            for (int id = 0; id < player_count; id++)
+                if ((kept_slots[id] >> slot) & 1)
+                    kept_paths_mask |= 1 << id;
+
+            Wall wall = grid->get_slot_wall(slot);
+            if (can_place_wall(wall))
+            {
+                moves[count] = Move(current_id, wall);
+                moves[count].score = score_move(my_id, moves[count]);
+                count++;
+            }
+        }
+        kept_paths_mask = 0;
+        return count;
+    }
+
     int get_next_id(int id)
     {
         id = (id + 1) % player_count;
@@ -1319,9 +2292,9 @@ public:
         else
         {
             undo_move(move);
-            players[winner_id].is_alive = false;
+            set_alive(winner_id, false);
             Score score = score_move_2_players(id, move);
-            players[winner_id].is_alive = true;
+            set_alive(winner_id, true);
             return Score(score.score, BoardState::LOST, score.first_place_state);
         }
 
@@ -1385,26 +2358,26 @@ public:
             else if (next_path_data.distance == 0)
             {
                 undo_move(move);
-                players[next_id].is_alive = false;
+                set_alive(next_id, false);
                 Score score = score_move_2_players(id, move);
-                players[next_id].is_alive = true;
+                set_alive(next_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
             else if (last_path_data.distance == 0)
             {
                 undo_move(move);
-                players[last_id].is_alive = false;
+                set_alive(last_id, false);
                 Score score = score_move_2_players(id, move);
-                players[last_id].is_alive = true;
+                set_alive(last_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
             // im out of walls and the next can finish next turn
             else if (current_walls_left == 0 && next_path_data.distance <= 1)
             {
                 undo_move(move);
-                players[next_id].is_alive = false;
+                set_alive(next_id, false);
                 Score score = score_move_2_players(id, move);
-                players[next_id].is_alive = true;
+                set_alive(next_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
             // I and the next is out of walls and the last can finish next turn
@@ -1412,9 +2385,9 @@ public:
                      last_path_data.distance <= 1)
             {
                 undo_move(move);
-                players[last_id].is_alive = false;
+                set_alive(last_id, false);
                 Score score = score_move_2_players(id, move);
-                players[last_id].is_alive = true;
+                set_alive(last_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
 
@@ -1442,199 +2415,1160 @@ public:
             else if (current_path_data.distance <= 1)
             {
                 undo_move(move);
-                players[current_id].is_alive = false;
+                set_alive(current_id, false);
                 Score score = score_move_2_players(id, move);
-                players[current_id].is_alive = true;
+                set_alive(current_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
             else if (last_path_data.distance == 0)
             {
                 undo_move(move);
-                players[last_id].is_alive = false;
+                set_alive(last_id, false);
+                Score score = score_move_2_players(id, move);
+                set_alive(last_id, true);
+                return Score(score.score, BoardState::LOST, score.first_place_state);
+            }
+            // I and the current is out of walls and the last can finish next turn
+            else if (current_walls_left == 0 && next_walls_left == 0 &&
+                     last_path_data.distance <= 1)
+            {
+                undo_move(move);
+                set_alive(last_id, false);
+                Score score = score_move_2_players(id, move);
+                set_alive(last_id, true);
+                return Score(score.score, BoardState::LOST, score.first_place_state);
+            }
+
+            int distance_score = current_path_data.distance + last_path_data.distance - next_path_data.distance * 2;
+            int wall_score = 2 * next_walls_left - current_walls_left - last_walls_left;
+
+            score = distance_score * distance_weight + wall_score * wall_weight;
+        }
+        else if (id == last_id)
+        {
+
+            // I finish next turn
+            if (last_path_data.distance == 0 ||
+                (last_path_data.distance == 1 && current_path_data.distance >= 2 && next_path_data.distance >= 2 &&
+                 current_walls_left == 0 && next_walls_left == 0))
+            {
+                first_place_state = BoardState::WON;
+            }
+            // opponents are out of walls and I'm the closest
+            else if (current_walls_left == 0 && next_walls_left == 0 &&
+                     last_path_data.distance < current_path_data.distance && last_path_data.distance < next_path_data.distance)
+            {
+                first_place_state = BoardState::WON;
+            }
+            // Opponents finishes next turn
+            else if (current_path_data.distance <= 1)
+            {
+                undo_move(move);
+                set_alive(current_id, false);
+                Score score = score_move_2_players(id, move);
+                set_alive(current_id, true);
+                return Score(score.score, BoardState::LOST, score.first_place_state);
+            }
+            else if (next_path_data.distance <= 1 && current_walls_left == 0)
+            {
+                undo_move(move);
+                set_alive(next_id, false);
                 Score score = score_move_2_players(id, move);
-                players[last_id].is_alive = true;
+                set_alive(next_id, true);
                 return Score(score.score, BoardState::LOST, score.first_place_state);
             }
-            // I and the current is out of walls and the last can finish next turn
-            else if (current_walls_left == 0 && next_walls_left == 0 &&
-                     last_path_data.distance <= 1)
+
+            int distance_score = current_path_data.distance + next_path_data.distance - last_path_data.distance * 2;
+            int wall_score = 2 * last_walls_left - current_walls_left - next_walls_left;
+
+            score = distance_score * distance_weight + wall_score * wall_weight;
+        }
+
+        undo_move(move);
+        return Score(score, first_place_state, second_place_state);
+    }
+
+    // The players in play in the order they finish a pawn race: shorter
+    // distance first, ties to whoever moves sooner. Returns their count.
+    int get_race_order(int *order)
+    {
+        int count = 0;
+        for (int offset = 0; offset < player_count; offset++)
+        {
+            int racer = (side_to_move + offset) % player_count;
+            if (!is_active(racer))
+                continue;
+            int i = count++;
+            for (; i > 0 && get_distance(order[i - 1]) > get_distance(racer); i--)
+                order[i] = order[i - 1];
+            order[i] = racer;
+        }
+        return count;
+    }
+
+    int get_num_finished()
+    {
+        int num_finished = 0;
+        for (int i = 0; i < player_count; i++)
+            num_finished += players[i].is_alive && players[i].is_finished;
+        return num_finished;
+    }
+
+    int get_walls_in_play()
+    {
+        int walls = 0;
+        for (int i = 0; i < player_count; i++)
+            if (is_active(i))
+                walls += players[i].walls_left;
+        return walls;
+    }
+
+    // Final rank of id (0 is first) once no wall is left: nothing can
+    // change the distances any more, so the race decides it
+    int get_race_rank(int id)
+    {
+        int order[MAX_PLAYERS];
+        int count = get_race_order(order);
+        int rank = get_num_finished();
+        for (int i = 0; i < count && order[i] != id; i++)
+            rank++;
+        return rank;
+    }
+
+    // Score of a decided race: the states of the rank, with the static
+    // score of the move only to tell equal ranks apart
+    Score get_rank_score(int rank, int score)
+    {
+        if (rank == 0)
+            return Score(score, BoardState::WON);
+        if (get_num_alive() == 2)
+            return Score(score, BoardState::LOST);
+        return Score(score, BoardState::LOST, rank == 1 ? BoardState::WON : BoardState::LOST);
+    }
+
+    // Proof-number search for two players in play with few walls left:
+    // looks for a win of id within a share of the turn and PROOF_MAX_NODES
+    // nodes. Returns true with the winning move once the win is proven.
+    // Only id's moves are pruned, so a failed proof says nothing about a
+    // loss and the heuristic search takes over.
+    bool find_proven_win(chrono::high_resolution_clock::time_point start_time, int time_micro, int id,
+                         Move &move)
+    {
+        if (get_num_playing() != 2 || !is_active(id) || get_walls_in_play() > PROOF_MAX_WALLS)
+            return false;
+
+        start_search(start_time, time_micro * PROOF_TIME_PERCENT / 100);
+        reset_hash(id);
+        proof_winning_rank = get_num_finished();
+        proof_attacker = id;
+        if (proof_table.empty())
+            proof_table.resize(PROOF_TABLE_SIZE);
+
+        Move moves[4 + MAX_SLOTS];
+        int move_count = get_proof_moves(moves);
+        ProofNumbers root;
+        int best_index = -1;
+        prove(PROOF_INFINITY, PROOF_INFINITY, moves, move_count, root, best_index);
+        if (is_aborted)
+            return false;
+
+        if (root.phi == 0)
+        {
+            cerr << "Proven win in " << node_count << " nodes" << endl;
+            move = moves[best_index];
+            return true;
+        }
+        return false;
+    }
+
+    // Moves of the side to move in a proof search. The attacker only steps
+    // along its shortest paths or places walls that may lengthen the other
+    // path, which can miss a proof but never make a wrong one. The defender
+    // gets every legal step and wall.
+    int get_proof_moves(Move *moves)
+    {
+        int mover = side_to_move;
+        bool is_attacker = mover == proof_attacker;
+        int count = 0;
+        Vector2 pos = players[mover].pos;
+        int distance = get_distance(mover);
+        for (int dir = 0; dir < 4; dir++)
+        {
+            Move step = get_step(mover, (Direction)dir);
+            Vector2 next = pos + step.direction;
+            if (grid->is_inside(next) && !grid->is_blocked(pos, next) &&
+                (!is_attacker || grid->get_path_data(next, players[mover].end_direction).distance == distance - 1))
+                moves[count++] = step;
+        }
+
+        if (players[mover].walls_left == 0)
+            return count;
+
+        Bitboard slots = grid->get_all_slots();
+        if (is_attacker)
+        {
+            slots = 0;
+            for (int other = 0; other < player_count; other++)
+                if (other != mover && is_active(other))
+                    slots |= grid->get_lengthening_slots(players[other].pos, players[other].end_direction);
+        }
+        for (; slots != 0; slots &= slots - 1)
+        {
+            Wall wall = grid->get_slot_wall(get_bit_index(slots & -slots));
+            if (can_place_wall(wall))
+                moves[count++] = Move(mover, wall);
+        }
+        return count;
+    }
+
+    // Depth-first proof-number search (df-pn) of the position: its numbers
+    // are min of the children's delta and sum of their phi, and the child
+    // with the smallest delta is searched until one of the numbers reaches
+    // its threshold. best_index is that child when the loop stops.
+    void prove(uint32_t phi_threshold, uint32_t delta_threshold, Move *moves, int move_count,
+               ProofNumbers &numbers, int &best_index)
+    {
+        ProofNumbers children[4 + MAX_SLOTS];
+        for (int i = 0; i < move_count; i++)
+        {
+            do_move(moves[i]);
+            children[i] = get_proof_numbers();
+            undo_move(moves[i]);
+        }
+
+        while (true)
+        {
+            uint32_t second_delta = PROOF_INFINITY;
+            numbers = {PROOF_INFINITY, 0};
+            for (int i = 0; i < move_count; i++)
+            {
+                if (children[i].delta < numbers.phi)
+                {
+                    second_delta = numbers.phi;
+                    numbers.phi = children[i].delta;
+                    best_index = i;
+                }
+                else if (children[i].delta < second_delta)
+                    second_delta = children[i].delta;
+                numbers.delta = std::min(numbers.delta + children[i].phi, PROOF_INFINITY);
+            }
+
+            if (numbers.phi >= phi_threshold || numbers.delta >= delta_threshold || is_out_of_time() ||
+                node_count > PROOF_MAX_NODES)
+                break;
+
+            ProofNumbers &child = children[best_index];
+            uint32_t child_phi_threshold = delta_threshold >= PROOF_INFINITY
+                                               ? PROOF_INFINITY
+                                               : delta_threshold - numbers.delta + child.phi;
+            uint32_t child_delta_threshold = std::min(phi_threshold, second_delta + 1);
+
+            Move move = moves[best_index];
+            do_move(move);
+            Move child_moves[4 + MAX_SLOTS];
+            int child_move_count = get_proof_moves(child_moves);
+            int child_best_index = -1;
+            prove(child_phi_threshold, child_delta_threshold, child_moves, child_move_count, child, child_best_index);
+            undo_move(move);
+        }
+
+        // Numbers of an aborted search are not what they claim
+        if (!is_aborted)
+            proof_table[hash & (PROOF_TABLE_SIZE - 1)] = {hash, (int8_t)proof_attacker, numbers};
+    }
+
+    // Numbers of the current position: exact once a player is through or no
+    // wall is left, else from the table, else one move each way. Past
+    // MAX_PLY the attacker is taken to fail, which only gives up a proof.
+    ProofNumbers get_proof_numbers()
+    {
+        bool is_won;
+        if (get_num_playing() <= 1 || get_walls_in_play() == 0)
+            is_won = get_race_rank(side_to_move) == proof_winning_rank;
+        else if (turn_count >= MAX_PLY)
+            is_won = side_to_move != proof_attacker;
+        else
+        {
+            const ProofEntry &entry = proof_table[hash & (PROOF_TABLE_SIZE - 1)];
+            if (entry.key == hash && entry.attacker == proof_attacker)
+                return entry.numbers;
+            return ProofNumbers();
+        }
+        return is_won ? ProofNumbers{0, PROOF_INFINITY} : ProofNumbers{PROOF_INFINITY, 0};
+    }
+
+    Score score_move(int depth, int breadth, Score alpha, Score beta, int id,
+                     Move move)
+    {
+        if (temp_wall_count > 4)
+            depth += 1;
+
+        if (depth == 0 || move.score.first_place_state == BoardState::WON || (move.score.first_place_state == BoardState::LOST && move.score.second_place_state != BoardState::UNDECIDED))
+        {
+            Score score = move.score;
+            score.depth = depth;
+            return score;
+        }
+
+        // The caller throws the score away once the search is aborted
+        if (is_out_of_time())
+            return move.score;
+
+        do_move(move);
+
+        // With no wall left the race decides the ranking exactly. Positions
+        // with a few walls left get no exact solver here: with every pawn
+        // step allowed their game graph has cycles, so a memoized search
+        // cannot be exact within a node budget. find_proven_win covers them
+        // at the root instead, exactly for wins only.
+        if (get_walls_in_play() == 0)
+        {
+            int rank = get_race_rank(id);
+            undo_move(move);
+            return get_rank_score(rank, move.score.score);
+        }
+
+        int16_t table_move = NO_MOVE;
+        TranspositionEntry entry;
+        if (table->probe(hash, entry))
+        {
+            table_move = entry.move;
+            if (entry.age == table->get_age() && entry.depth >= depth)
+            {
+                Score score = entry.get_score();
+                if (entry.bound == Bound::EXACT ||
+                    (entry.bound == Bound::LOWER && score >= beta) ||
+                    (entry.bound == Bound::UPPER && score <= alpha))
+                {
+                    undo_move(move);
+                    return score;
+                }
+            }
+        }
+
+        // Best-Reply Search gives the turn back to id after any reply
+        int next_id = get_next_id(move.id);
+        bool is_best_reply = multi_player_search == MultiPlayerSearch::BEST_REPLY && get_num_playing() > 2;
+        if (is_best_reply && move.id != id)
+            next_id = id;
+
+        bool is_maximizing = id == next_id;
+        if (is_maximizing)
+        {
+            MoveGenerator moves(this, id, next_id, breadth, temp_wall_count <= 4, table_move, true);
+
+            Score start_alpha = alpha;
+            Score best_score = Score(-999999, BoardState::LOST);
+            int16_t best_move = NO_MOVE;
+            bool is_cutoff = false;
+            Move new_move;
+            for (int i = 0; moves.next(new_move); i++)
+            {
+                Score score = search_child(depth - 1, breadth, alpha, beta, id, new_move, i == 0, true);
+                if (is_cancelled())
+                {
+                    undo_move(move);
+                    return best_score;
+                }
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_move = encode_move(new_move);
+
+                    alpha = max(alpha, best_score);
+                    if (beta <= alpha || best_score.first_place_state == BoardState::WON)
+                    {
+                        record_cutoff(new_move, depth);
+                        is_cutoff = true;
+                        break;
+                    }
+                }
+                if (i == 0 && can_split(depth))
+                {
+                    split_children(moves, depth, breadth, id, true, alpha, beta, best_score, best_move, is_cutoff);
+                    if (is_cancelled())
+                    {
+                        undo_move(move);
+                        return best_score;
+                    }
+                    break;
+                }
+            }
+
+            Bound bound = is_cutoff ? Bound::LOWER : (best_score > start_alpha ? Bound::EXACT : Bound::UPPER);
+            table->store(hash, best_score, depth, bound, best_move);
+
+            undo_move(move);
+            return best_score;
+        }
+        else
+        {
+            // The players that may reply: the next one, or with Best-Reply
+            // Search every opponent in turn order, the others passing
+            int repliers[MAX_PLAYERS] = {next_id};
+            int replier_count = 1;
+            if (is_best_reply)
+                for (int other = get_next_id(next_id); other != id && other != next_id; other = get_next_id(other))
+                    repliers[replier_count++] = other;
+
+            Score start_beta = beta;
+            Score best_score = Score(999999, BoardState::WON);
+            int16_t best_move = NO_MOVE;
+            bool is_cutoff = false;
+            Move new_move;
+            for (int r = 0; r < replier_count && !is_cutoff; r++)
+            {
+                MoveGenerator moves(this, id, repliers[r], breadth, temp_wall_count <= 4, table_move, false);
+                for (int i = 0; moves.next(new_move); i++)
+                {
+                    Score score = search_child(depth - 1, breadth, alpha, beta, id, new_move, r == 0 && i == 0, false);
+                    if (is_cancelled())
+                    {
+                        undo_move(move);
+                        return best_score;
+                    }
+                    if (score < best_score)
+                    {
+                        best_score = score;
+                        best_move = encode_move(new_move);
+                        beta = min(beta, best_score);
+                        if (beta <= alpha || (best_score.first_place_state == BoardState::LOST && best_score.second_place_state == BoardState::LOST))
+                        {
+                            record_cutoff(new_move, depth);
+                            is_cutoff = true;
+                            break;
+                        }
+                    }
+                    if (i == 0 && can_split(depth))
+                    {
+                        split_children(moves, depth, breadth, id, false, alpha, beta, best_score, best_move, is_cutoff);
+                        if (is_cancelled())
+                        {
+                            undo_move(move);
+                            return best_score;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            Bound bound = is_cutoff ? Bound::UPPER : (best_score < start_beta ? Bound::EXACT : Bound::LOWER);
+            table->store(hash, best_score, depth, bound, best_move);
+
+            undo_move(move);
+            return best_score;
+        }
+
+        undo_move(move);
+        return Score(0, BoardState::ILLEGAL);
+    }
+
+    // Max-n: every player picks the child that is best for itself, and
+    // values[p] is the score of the line from player p's view. With no side
+    // that shares our interest nothing is pruned but decided lines.
+    void score_move_max_n(int depth, int breadth, Move move, Score *values)
+    {
+        if (temp_wall_count > 4)
+            depth += 1;
+
+        // The caller throws the values away once the search is aborted
+        if (depth == 0 || move.score.first_place_state == BoardState::WON ||
+            (move.score.first_place_state == BoardState::LOST && move.score.second_place_state != BoardState::UNDECIDED) ||
+            is_out_of_time())
+        {
+            for (int i = 0; i < player_count; i++)
+                if (i == move.id)
+                    values[i] = move.score;
+                else if (players[i].is_alive && !players[i].is_finished)
+                    values[i] = score_move(i, move);
+                else
+                    values[i] = Score();
+            return;
+        }
+
+        do_move(move);
+
+        int next_id = get_next_id(move.id);
+        MoveGenerator moves(this, next_id, next_id, breadth, temp_wall_count <= 4, NO_MOVE, true);
+        Score child_values[MAX_PLAYERS];
+        Move new_move;
+        for (int i = 0; moves.next(new_move); i++)
+        {
+            score_move_max_n(depth - 1, breadth, new_move, child_values);
+            if (is_cancelled())
+                break;
+            if (i == 0 || child_values[next_id] > values[next_id])
+            {
+                std::copy(child_values, child_values + player_count, values);
+                if (values[next_id].first_place_state == BoardState::WON)
+                    break;
+            }
+        }
+
+        undo_move(move);
+    }
+
+    bool uses_max_n() { return multi_player_search == MultiPlayerSearch::MAX_N && get_num_playing() > 2; }
+
+    // Principal variation search: the first child gets the full window, the
+    // others a null window next to the bound the parent is trying to improve,
+    // and are searched again on the full window only if they beat it.
+    Score search_child(int depth, int breadth, Score alpha, Score beta, int id, Move move,
+                       bool is_first, bool is_maximizing)
+    {
+        if (is_first)
+            return score_move(depth, breadth, alpha, beta, id, move);
+
+        if (is_maximizing)
+        {
+            Score score = score_move(depth, breadth, alpha, alpha.get_next(), id, move);
+            if (!is_cancelled() && score > alpha && score < beta)
+                score = score_move(depth, breadth, alpha, beta, id, move);
+            return score;
+        }
+
+        Score score = score_move(depth, breadth, beta.get_previous(), beta, id, move);
+        if (!is_cancelled() && score < beta && score > alpha)
+            score = score_move(depth, breadth, alpha, beta, id, move);
+        return score;
+    }
+
+    // Young Brothers Wait: once the eldest child of a node is searched, the
+    // younger ones are shared with the idle threads of the pool
+    bool can_split(int depth)
+    {
+        return pool != nullptr && depth >= MIN_SPLIT_DEPTH && turn_count <= MAX_PLY &&
+               pool->idle_count.load(memory_order_relaxed) > 0;
+    }
+
+    // Opens a split point for the children the generator has left, searches
+    // them along with the helpers and waits for the helpers to leave. The
+    // window, best score and move come back through the references.
+    void split_children(MoveGenerator &moves, int depth, int breadth, int id, bool is_maximizing,
+                        Score &alpha, Score &beta, Score &best_score, int16_t &best_move, bool &is_cutoff)
+    {
+        SplitPoint split;
+        split.parent = active_split;
+        std::copy(path, path + turn_count, split.path);
+        split.path_length = turn_count;
+        split.depth = depth;
+        split.breadth = breadth;
+        split.id = id;
+        split.is_maximizing = is_maximizing;
+
+        Move move;
+        split.move_count = 0;
+        while (split.move_count < MAX_STAGED_WALLS + 1 && moves.next(move))
+            split.moves[split.move_count++] = move;
+        split.next_move = 0;
+        split.alpha = alpha;
+        split.beta = beta;
+        split.best_score = best_score;
+        split.best_move = best_move;
+        split.is_cutoff = false;
+        split.helper_count = 0;
+        split.is_stopped = false;
+
+        {
+            lock_guard<mutex> guard(pool->lock);
+            pool->splits.push_back(&split);
+        }
+        pool->wake.notify_all();
+
+        search_split(split);
+
+        {
+            lock_guard<mutex> guard(pool->lock);
+            pool->splits.erase(std::find(pool->splits.begin(), pool->splits.end(), &split));
+        }
+        if (is_cancelled())
+            split.is_stopped = true;
+        while (split.helper_count.load() != 0)
+            this_thread::yield();
+
+        alpha = split.alpha;
+        beta = split.beta;
+        best_score = split.best_score;
+        best_move = split.best_move;
+        is_cutoff = split.is_cutoff;
+    }
+
+    // Takes children of the split point one at a time until none are left or
+    // a cutoff stops it. The board must be at the split node.
+    void search_split(SplitPoint &split)
+    {
+        SplitPoint *outer_split = active_split;
+        active_split = &split;
+        while (true)
+        {
+            Move move;
+            Score alpha;
+            Score beta;
+            {
+                lock_guard<mutex> guard(split.lock);
+                if (split.is_stopped || split.next_move == split.move_count)
+                    break;
+                move = split.moves[split.next_move++];
+                alpha = split.alpha;
+                beta = split.beta;
+            }
+
+            Score score = search_child(split.depth - 1, split.breadth, alpha, beta, split.id, move, false,
+                                       split.is_maximizing);
+            if (is_cancelled())
+                break;
+
+            lock_guard<mutex> guard(split.lock);
+            if (split.is_maximizing ? score > split.best_score : score < split.best_score)
             {
-                undo_move(move);
-                players[last_id].is_alive = false;
-                Score score = score_move_2_players(id, move);
-                players[last_id].is_alive = true;
-                return Score(score.score, BoardState::LOST, score.first_place_state);
+                split.best_score = score;
+                split.best_move = encode_move(move);
+
+                bool is_cutoff;
+                if (split.is_maximizing)
+                {
+                    split.alpha = max(split.alpha, score);
+                    is_cutoff = split.beta <= split.alpha || score.first_place_state == BoardState::WON;
+                }
+                else
+                {
+                    split.beta = min(split.beta, score);
+                    is_cutoff = split.beta <= split.alpha || (score.first_place_state == BoardState::LOST &&
+                                                              score.second_place_state == BoardState::LOST);
+                }
+                if (is_cutoff)
+                {
+                    record_cutoff(move, split.depth);
+                    split.is_cutoff = true;
+                    split.is_stopped = true;
+                }
             }
+        }
+        active_split = outer_split;
+    }
 
-            int distance_score = current_path_data.distance + last_path_data.distance - next_path_data.distance * 2;
-            int wall_score = 2 * next_walls_left - current_walls_left - last_walls_left;
+    // Helper thread of a Young Brothers Wait search: joins split points that
+    // still have children left, replaying the path from the root to reach
+    // them, until the pool is closed
+    void run_worker(chrono::high_resolution_clock::time_point start_time, int time_micro, int id)
+    {
+        start_search(start_time, time_micro);
+        reset_hash(id);
+        new_search_ordering();
+        temp_wall_count = 0;
 
-            score = distance_score * distance_weight + wall_score * wall_weight;
+        unique_lock<mutex> lock(pool->lock);
+        while (true)
+        {
+            SplitPoint *split = nullptr;
+            pool->idle_count++;
+            while (!pool->is_closed && (split = get_open_split()) == nullptr)
+                pool->wake.wait(lock);
+            pool->idle_count--;
+            if (pool->is_closed)
+                return;
+
+            split->helper_count++;
+            lock.unlock();
+
+            for (int i = 0; i < split->path_length; i++)
+                do_move(split->path[i]);
+            search_split(*split);
+            for (int i = split->path_length - 1; i >= 0; i--)
+                undo_move(split->path[i]);
+
+            lock.lock();
+            split->helper_count--;
         }
-        else if (id == last_id)
+    }
+
+    // Newest split point with children left; the pool lock must be held
+    SplitPoint *get_open_split()
+    {
+        for (int i = (int)pool->splits.size() - 1; i >= 0; i--)
         {
+            SplitPoint *split = pool->splits[i];
+            lock_guard<mutex> guard(split->lock);
+            if (!split->is_stopped && split->next_move < split->move_count)
+                return split;
+        }
+        return nullptr;
+    }
 
-            // I finish next turn
-            if (last_path_data.distance == 0 ||
-                (last_path_data.distance == 1 && current_path_data.distance >= 2 && next_path_data.distance >= 2 &&
-                 current_walls_left == 0 && next_walls_left == 0))
+    // Searches every root move to the given depth within the (alpha, beta)
+    // window until the deadline set by start_search. Each fully searched move
+    // gets its score written back so the caller can reorder the root moves,
+    // and best_move is the best of those. Returns the number of root moves
+    // fully searched.
+    int search_root(MaxMovesArray *moves, int depth, int breadth, int id, Score alpha, Score beta,
+                    Move &best_move)
+    {
+        Score best_score = Score(-999999, BoardState::LOST);
+        best_move = Move(id, Vector2(0, 0));
+
+        temp_wall_count = 0;
+        bool is_max_n = uses_max_n();
+        for (int i = 0; i < moves->size(); i++)
+        {
+            Move *move = moves->get_ref(i);
+
+            Score score;
+            if (is_max_n)
             {
-                first_place_state = BoardState::WON;
+                Score values[MAX_PLAYERS];
+                score_move_max_n(depth, breadth, *move, values);
+                score = values[id];
             }
-            // opponents are out of walls and I'm the closest
-            else if (current_walls_left == 0 && next_walls_left == 0 &&
-                     last_path_data.distance < current_path_data.distance && last_path_data.distance < next_path_data.distance)
+            else
+                score = search_child(depth, breadth, alpha, beta, id, *move, i == 0, true);
+            if (is_aborted || chrono::high_resolution_clock::now() > deadline)
             {
-                first_place_state = BoardState::WON;
+                if (thread_index == 0)
+                    cerr << "Time out at depth " << depth << ", checked " << i << " moves" << endl;
+                is_aborted = true;
+                return i;
             }
-            // Opponents finishes next turn
-            else if (current_path_data.distance <= 1)
+
+            move->score = score;
+            // debug_move(*move);
+            if (score > best_score)
             {
-                undo_move(move);
-                players[current_id].is_alive = false;
-                Score score = score_move_2_players(id, move);
-                players[current_id].is_alive = true;
-                return Score(score.score, BoardState::LOST, score.first_place_state);
+                best_score = score;
+                best_move = *move;
+
+                alpha = max(alpha, best_score);
+                if (beta <= alpha || alpha.first_place_state == BoardState::WON)
+                    return i + 1;
             }
-            else if (next_path_data.distance <= 1 && current_walls_left == 0)
+        }
+
+        return moves->size();
+    }
+
+    Move *get_winning_move(MaxMovesArray *moves)
+    {
+        for (int i = 0; i < moves->size(); i++)
+            if (moves->get(i).score.first_place_state == BoardState::WON)
+                return moves->get_ref(i);
+        return nullptr;
+    }
+
+    // Iterative deepening with thread_count - 1 helper threads, each on its
+    // own copy of the board. With Lazy SMP they run the same iterative
+    // deepening, every other one a ply ahead, and share what they find
+    // through the transposition table; the move of the deepest iteration any
+    // thread completed is played. With Young Brothers Wait they wait in a
+    // pool for split points of this thread's search instead. Either way they
+    // stop once this thread is done. multi_player picks how the opponents
+    // are searched while three players are in play. A win proven by
+    // find_proven_win is played without any of it.
+    Move get_best_move_iterative(int max_depth, int breadth, int time_micro, int id, int thread_count,
+                                 ParallelSearch parallel, MultiPlayerSearch multi_player)
+    {
+        auto start_time = chrono::high_resolution_clock::now();
+        table->new_search();
+        multi_player_search = multi_player;
+
+        Move proven_move;
+        if (find_proven_win(start_time, time_micro, id, proven_move))
+            return proven_move;
+
+        atomic<bool> stop(false);
+        SearchPool search_pool;
+        vector<Board *> helpers;
+        vector<thread> threads;
+        vector<Move> helper_moves(thread_count);
+        vector<int> helper_depths(thread_count, 0);
+        for (int i = 1; i < thread_count; i++)
+        {
+            Board *helper = new Board(*this, i);
+            helper->stop_signal = &stop;
+            helpers.push_back(helper);
+            if (parallel == ParallelSearch::YOUNG_BROTHERS_WAIT)
             {
-                undo_move(move);
-                players[next_id].is_alive = false;
-                Score score = score_move_2_players(id, move);
-                players[next_id].is_alive = true;
-                return Score(score.score, BoardState::LOST, score.first_place_state);
+                helper->pool = &search_pool;
+                threads.emplace_back(&Board::run_worker, helper, start_time, time_micro, id);
             }
+            else
+                threads.emplace_back(&Board::search_iterative, helper, max_depth, breadth, start_time, time_micro,
+                                     id, ref(helper_moves[i]), ref(helper_depths[i]));
+        }
+        if (parallel == ParallelSearch::YOUNG_BROTHERS_WAIT && thread_count > 1)
+            pool = &search_pool;
 
-            int distance_score = current_path_data.distance + next_path_data.distance - last_path_data.distance * 2;
-            int wall_score = 2 * last_walls_left - current_walls_left - next_walls_left;
+        Move best_move;
+        int completed_depth;
+        search_iterative(max_depth, breadth, start_time, time_micro, id, best_move, completed_depth);
+        pool = nullptr;
 
-            score = distance_score * distance_weight + wall_score * wall_weight;
+        stop = true;
+        {
+            lock_guard<mutex> guard(search_pool.lock);
+            search_pool.is_closed = true;
+        }
+        search_pool.wake.notify_all();
+        for (thread &helper_thread : threads)
+            helper_thread.join();
+        for (int i = 1; i < thread_count; i++)
+        {
+            if (helper_depths[i] > completed_depth)
+            {
+                completed_depth = helper_depths[i];
+                best_move = helper_moves[i];
+            }
+            delete helpers[i - 1];
         }
+        cerr << "Depth: " << completed_depth << endl;
 
-        undo_move(move);
-        return Score(score, first_place_state, second_place_state);
+        return best_move;
     }
 
-    Score score_move(int depth, int breadth, Score alpha, Score beta, int id,
-                     Move move)
+    // Iterative deepening: searches depth 1, 2, 3, ... up to max_depth, from
+    // depth 2 on odd helper threads, and returns the best move of the last
+    // iteration that finished in time, or of an unfinished one if it already
+    // found something better. Root moves are reordered by the previous
+    // iteration's scores, and the next iteration is skipped when its
+    // predicted cost (growth of the last two iterations) would run past the
+    // budget. A move decided at the root counts as searched to max_depth.
+    void search_iterative(int max_depth, int breadth, chrono::high_resolution_clock::time_point start_time,
+                          int time_micro, int id, Move &best_move, int &completed_depth)
     {
-        if (temp_wall_count > 4)
-            depth += 1;
+        start_search(start_time, time_micro);
+        reset_hash(id);
+        new_search_ordering();
 
-        if (depth == 0 || move.score.first_place_state == BoardState::WON || (move.score.first_place_state == BoardState::LOST && move.score.second_place_state != BoardState::UNDECIDED))
+        MaxMovesArray *moves = get_maximizing_moves(id, id, 20, true);
+        Move *winning_move = get_winning_move(moves);
+        if (winning_move != nullptr || moves->size() == 0)
         {
-            Score score = move.score;
-            score.depth = depth;
-            return score;
+            best_move = winning_move != nullptr ? *winning_move : Move(id, Vector2(0, 0));
+            completed_depth = winning_move != nullptr ? max_depth : 0;
+            delete moves;
+            return;
         }
 
-        do_move(move);
-
-        int next_id = get_next_id(move.id);
-        bool is_maximizing = id == next_id;
-        if (is_maximizing)
+        best_move = moves->get(0);
+        long long previous_micros = 0;
+        long long last_micros = 0;
+        completed_depth = 0;
+        for (int depth = 1 + thread_index % 2; depth <= max_depth; depth++)
         {
-            MaxMovesArray *moves =
-                get_maximizing_moves(id, next_id, breadth, temp_wall_count <= 4);
+            auto iteration_start = chrono::high_resolution_clock::now();
 
-            Score best_score = Score(-999999, BoardState::LOST);
-            for (int i = 0; i < moves->size(); i++)
+            // Aspiration window around the previous score, widened to the
+            // failing side when the result falls outside it
+            Score alpha = Score(-999999, BoardState::LOST);
+            Score beta = Score(999999, BoardState::WON);
+            // Max-n does not prune, so a window would only cost re-searches
+            if (completed_depth > 0 && !uses_max_n() && best_move.score.first_place_state == BoardState::UNDECIDED &&
+                best_move.score.second_place_state == BoardState::UNDECIDED)
             {
-                Move new_move = moves->get(i);
-                Score score = score_move(depth - 1, breadth, alpha, beta, id, new_move);
-                if (score > best_score)
-                {
-                    best_score = score;
+                alpha = Score(best_move.score.score - ASPIRATION_WINDOW, BoardState::UNDECIDED);
+                beta = Score(best_move.score.score + ASPIRATION_WINDOW, BoardState::UNDECIDED);
+            }
 
-                    alpha = max(alpha, best_score);
-                    if (beta <= alpha || best_score.first_place_state == BoardState::WON)
+            while (true)
+            {
+                Move iteration_best;
+                int searched = search_root(moves, depth, breadth, id, alpha, beta, iteration_best);
+                // The previous best is searched first, so any fully searched
+                // move that beats alpha is an improvement even if time ran out
+                if (searched > 0 && iteration_best.score > alpha)
+                    best_move = iteration_best;
+                if (is_aborted)
+                    break;
+
+                if (iteration_best.score <= alpha)
+                    alpha = Score(-999999, BoardState::LOST);
+                else if (iteration_best.score >= beta)
+                    beta = Score(999999, BoardState::WON);
+                else
+                    break;
+            }
+            if (is_aborted)
+                break;
+            completed_depth = depth;
+
+            auto now = chrono::high_resolution_clock::now();
+            long long elapsed = chrono::duration_cast<chrono::microseconds>(now - start_time).count();
+            previous_micros = last_micros;
+            last_micros = chrono::duration_cast<chrono::microseconds>(now - iteration_start).count();
+
+            // The same decided scores score_move stops at: with three
+            // players a lost first place leaves second place to play for
+            if (best_move.score.first_place_state == BoardState::WON ||
+                (best_move.score.first_place_state == BoardState::LOST &&
+                 best_move.score.second_place_state != BoardState::UNDECIDED))
+                break;
+
+            long long growth = previous_micros > 0 ? last_micros / previous_micros + 1 : 4;
+            if (elapsed + last_micros * std::max(2LL, growth) > time_micro)
+                break;
+
+            moves->sort();
+            for (int i = 1; i < moves->size(); i++)
+                if (encode_move(moves->get(i)) == encode_move(best_move))
+                    moves->move_to_front(i);
+        }
+
+        delete moves;
+    }
+
+    // Monte Carlo tree search for the player id until the deadline. Every
+    // player picks children by UCT on its own rewards (max-n), and the wall
+    // moves of a node are opened by progressive widening, best scored first.
+    // The move with the most visits is played.
+    Move get_best_move_mcts(int time_micro, int id)
+    {
+        auto start_time = chrono::high_resolution_clock::now();
+        start_search(start_time, time_micro);
+        reset_hash(id);
+
+        mcts_nodes.clear();
+        mcts_nodes.reserve(MCTS_MAX_NODES);
+        mcts_nodes.push_back({NO_MOVE, (int8_t)id, 0, 0, 0, 0});
+        expand_mcts_node(0);
+        if (mcts_nodes[0].child_count == 1)
+            return decode_move(id, mcts_nodes[1].move);
+
+        int playouts = 0;
+        for (; !is_out_of_time(); playouts++)
+        {
+            int path[MAX_PLY];
+            int path_length = 0;
+            int finish_order[MAX_PLAYERS];
+            int finish_count = 0;
+
+            // Selection and expansion
+            int node = 0;
+            while (path_length < MAX_PLY && get_num_playing() > 1)
+            {
+                if (mcts_nodes[node].child_count == 0)
+                {
+                    if (mcts_nodes[node].visits == 0 ||
+                        (int)mcts_nodes.size() + MCTS_MAX_WALLS + 1 > MCTS_MAX_NODES || is_out_of_time())
+                        break;
+                    expand_mcts_node(node);
+                    if (is_aborted)
                         break;
                 }
+                node = select_mcts_child(node);
+                play_tracked(decode_move(mcts_nodes[node].mover, mcts_nodes[node].move), finish_order,
+                             finish_count);
+                path[path_length++] = node;
             }
 
-            delete moves;
-            undo_move(move);
-            return best_score;
-        }
-        else
-        {
-            MinMovesArray *moves =
-                get_minimizing_moves(id, next_id, breadth, temp_wall_count <= 4);
+            // Playout
+            Move playout[MCTS_PLAYOUT_PLIES];
+            int playout_length = 0;
+            while (playout_length < MCTS_PLAYOUT_PLIES && get_num_playing() > 1 && has_walls_in_play() &&
+                   !is_out_of_time())
+            {
+                Move move = get_playout_move(side_to_move);
+                play_tracked(move, finish_order, finish_count);
+                playout[playout_length++] = move;
+            }
 
-            Score best_score = Score(999999, BoardState::WON);
-            for (int i = 0; i < moves->size(); i++)
+            // A playout cut by the deadline is dropped unscored
+            if (!is_aborted)
             {
-                Move new_move = moves->get(i);
+                float rewards[MAX_PLAYERS];
+                get_race_rewards(finish_order, finish_count, rewards);
 
-                Score score = score_move(depth - 1, breadth, alpha, beta, id, new_move);
-                if (score < best_score)
+                mcts_nodes[0].visits++;
+                for (int i = 0; i < path_length; i++)
                 {
-                    best_score = score;
-                    beta = min(beta, best_score);
-                    if (beta <= alpha || (best_score.first_place_state == BoardState::LOST && best_score.second_place_state == BoardState::LOST))
-                        break;
+                    MctsNode &visited = mcts_nodes[path[i]];
+                    visited.visits++;
+                    visited.reward += rewards[visited.mover];
                 }
             }
 
-            delete moves;
-            undo_move(move);
-            return best_score;
+            while (playout_length > 0)
+                undo_move(playout[--playout_length]);
+            while (path_length > 0)
+            {
+                const MctsNode &visited = mcts_nodes[path[--path_length]];
+                undo_move(decode_move(visited.mover, visited.move));
+            }
         }
 
-        undo_move(move);
-        return Score(0, BoardState::ILLEGAL);
+        const MctsNode &root = mcts_nodes[0];
+        int best_child = root.first_child;
+        for (int i = root.first_child; i < root.first_child + root.child_count; i++)
+            if (mcts_nodes[i].visits > mcts_nodes[best_child].visits)
+                best_child = i;
+        cerr << "Playouts: " << playouts << ", nodes: " << mcts_nodes.size() << endl;
+        return decode_move(id, mcts_nodes[best_child].move);
     }
 
-    Move get_best_move(int depth, int breadth, int time_micro, int id)
+    // Children of a node: the pawn move along the shortest path, then the
+    // best scored walls that may lengthen an opponent's path
+    void expand_mcts_node(int node)
     {
-        auto start_time = chrono::high_resolution_clock::now();
+        int id = side_to_move;
+        mcts_nodes[node].first_child = mcts_nodes.size();
+        mcts_nodes.push_back({encode_move(get_best_direction(id)), (int8_t)id, 0, 0, 0, 0});
 
-        MaxMovesArray *moves = get_maximizing_moves(id, id, 20, true);
-        Score best_score = Score(-999999, BoardState::LOST);
-        Move best_move = Move(id, Vector2(0, 0));
+        if (players[id].walls_left > 0)
+        {
+            Bitboard threatening = 0;
+            for (int other = 0; other < player_count; other++)
+                if (other != id && is_active(other))
+                    threatening |= grid->get_lengthening_slots(players[other].pos, players[other].end_direction);
 
-        temp_wall_count = 0;
-        Score alpha = Score(-999999, BoardState::LOST);
-        for (int i = 0; i < moves->size(); i++)
+            Move scored[MAX_SLOTS];
+            int scored_count = score_walls(id, id, threatening, scored);
+            MaxMovesArray walls(MCTS_MAX_WALLS);
+            for (int i = 0; i < scored_count; i++)
+                walls.push(scored[i]);
+            walls.sort();
+            for (int i = 0; i < walls.size(); i++)
+                mcts_nodes.push_back({encode_move(walls.get(i)), (int8_t)id, 0, 0, 0, 0});
+        }
+        mcts_nodes[node].child_count = mcts_nodes.size() - mcts_nodes[node].first_child;
+    }
+
+    // UCT over the children opened so far; an unvisited one goes first
+    int select_mcts_child(int node)
+    {
+        const MctsNode &parent = mcts_nodes[node];
+        int open_count = std::min(parent.child_count, 1 + (int)(MCTS_WIDENING * sqrt((double)parent.visits)));
+        double log_visits = log((double)std::max(parent.visits, 1));
+
+        int best_child = parent.first_child;
+        double best_value = -1;
+        for (int i = parent.first_child; i < parent.first_child + open_count; i++)
         {
-            Move move = moves->get(i);
+            const MctsNode &child = mcts_nodes[i];
+            if (child.visits == 0)
+                return i;
 
-            if (move.score.first_place_state == BoardState::WON)
+            double value = child.reward / child.visits + MCTS_EXPLORATION * sqrt(log_visits / child.visits);
+            if (value > best_value)
             {
-                delete moves;
-                return move;
+                best_value = value;
+                best_child = i;
             }
-            Score score = score_move(depth, breadth, alpha, Score(999999, BoardState::WON), id, move);
-            move.score = score;
-            // debug_move(move);
-            if (score > best_score)
-            {
-                best_score = score;
-                best_move = move;
+        }
+        return best_child;
+    }
 
-                alpha = best_score;
-                if (alpha.first_place_state == BoardState::WON)
-                    break;
-            }
+    // The step along the shortest path, or now and then a random wall that
+    // may lengthen the path of the opponent closest to its goal
+    Move get_playout_move(int id)
+    {
+        if (players[id].walls_left > 0 && get_random() % 100 < MCTS_WALL_PERCENT)
+        {
+            int leader = -1;
+            for (int other = 0; other < player_count; other++)
+                if (other != id && is_active(other) &&
+                    (leader == -1 || get_distance(other) < get_distance(leader)))
+                    leader = other;
 
-            auto end_time = chrono::high_resolution_clock::now();
-            if (chrono::duration_cast<chrono::microseconds>(end_time - start_time)
-                    .count() > time_micro)
+            Bitboard slots = grid->get_lengthening_slots(players[leader].pos, players[leader].end_direction);
+            int slot_count = 0;
+            int candidates[MAX_SLOTS];
+            for (; slots != 0; slots &= slots - 1)
+                candidates[slot_count++] = get_bit_index(slots & -slots);
+            if (slot_count > 0)
             {
-                cerr << "Time out: " << chrono::duration_cast<chrono::microseconds>(end_time - start_time).count()
-                     << endl;
-                cerr << "Checked " << (i + 1) << " moves" << endl;
-                break;
+                Wall wall = grid->get_slot_wall(candidates[get_random() % slot_count]);
+                if (can_place_wall(wall))
+                    return Move(id, wall);
             }
         }
+        return get_best_direction(id);
+    }
 
-        delete moves;
-        best_move.score = best_score;
+    void play_tracked(Move move, int *finish_order, int &finish_count)
+    {
+        bool was_finished = players[move.id].is_finished;
+        do_move(move);
+        if (!was_finished && players[move.id].is_finished)
+            finish_order[finish_count++] = move.id;
+    }
 
-        // if (best_move.score == LOST)
-        //     return get_best_direction(id);
+    bool is_active(int id) { return players[id].is_alive && !players[id].is_finished; }
 
-        return best_move;
+    bool has_walls_in_play()
+    {
+        for (int i = 0; i < player_count; i++)
+            if (is_active(i) && players[i].walls_left > 0)
+                return true;
+        return false;
+    }
+
+    // Rewards from the finishing order: the players that finished during the
+    // simulation first, then the rest as a pawn race, shorter distance first
+    // and ties to whoever moves sooner. Rank r of n gets 1 - r / (n - 1).
+    void get_race_rewards(const int *finish_order, int finish_count, float *rewards)
+    {
+        int ranking[MAX_PLAYERS];
+        std::copy(finish_order, finish_order + finish_count, ranking);
+        int count = finish_count + get_race_order(ranking + finish_count);
+
+        fill_n(rewards, MAX_PLAYERS, 0.0f);
+        for (int rank = 0; rank < count; rank++)
+            rewards[ranking[rank]] = count > 1 ? 1.0f - (float)rank / (count - 1) : 1.0f;
+    }
+
+    // xorshift64
+    uint32_t get_random()
+    {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return (uint32_t)(random_state >> 32);
+    }
+
+    Move decode_move(int id, int16_t encoded)
+    {
+        if (encoded < MAX_SLOTS)
+            return Move(id, grid->get_slot_wall(encoded));
+        return get_step(id, (Direction)(encoded - MAX_SLOTS));
+    }
+
+    int16_t encode_move(Move move)
+    {
+        if (move.is_wall)
+            return grid->get_slot_index(move.wall);
+        if (move.direction.y == -1)
+            return MAX_SLOTS + (int)Direction::UP;
+        if (move.direction.y == 1)
+            return MAX_SLOTS + (int)Direction::DOWN;
+        if (move.direction.x == -1)
+            return MAX_SLOTS + (int)Direction::LEFT;
+        return MAX_SLOTS + (int)Direction::RIGHT;
+    }
+
+    // Killer walls are kept per ply; turn_count is the ply of the node
+    // whose children are being ordered
+    int16_t *get_killers() { return killers[std::min(turn_count, MAX_PLY - 1)]; }
+
+    void record_cutoff(Move move, int depth)
+    {
+        int16_t encoded = encode_move(move);
+        history[move.id][encoded] += depth * depth;
+        if (!move.is_wall)
+            return;
+
+        int16_t *ply_killers = get_killers();
+        if (ply_killers[0] == encoded)
+            return;
+        for (int i = NUM_KILLERS - 1; i > 0; i--)
+            ply_killers[i] = ply_killers[i - 1];
+        ply_killers[0] = encoded;
+    }
+
+    // Killers are only meaningful within one search; history is halved so
+    // that older searches still count but fade out
+    void new_search_ordering()
+    {
+        std::fill(&killers[0][0], &killers[0][0] + MAX_PLY * NUM_KILLERS, (int16_t)NO_MOVE);
+        for (int id = 0; id < MAX_PLAYERS; id++)
+            for (int i = 0; i < MAX_ENCODED_MOVES; i++)
+                history[id][i] /= 2;
     }
 
     void print_move(Move move)
@@ -1747,27 +3681,95 @@ public:
     }
 
 private:
-    int width;
-    int height;
-    int player_count;
-    WallGrid *grid;
+    Dimension<W> width;
+    Dimension<H> height;
+    Dimension<P> player_count;
+    WallGrid<W, H> *grid;
     Player *players;
+    TranspositionTable *table;
+    bool owns_table;
+    int thread_index = 0; // 0 for the thread that plays the move
+    MultiPlayerSearch multi_player_search = MultiPlayerSearch::PARANOID;
     int turn_count = 0;
+    int side_to_move = 0;
+    uint64_t hash = 0;
+
+    uint64_t get_pawn_key(int id)
+    {
+        if (!grid->is_inside(players[id].pos))
+            return 0;
+        return ZOBRIST.pawns[id][grid->get_index(players[id].pos)];
+    }
+
+    uint64_t get_walls_left_key(int id)
+    {
+        return ZOBRIST.walls_left[id][clamp(players[id].walls_left, 0, MAX_WALLS_LEFT)];
+    }
 
     int temp_wall_count;
     int data[4] = {1, 1, 1, 1};
+
+    int16_t killers[MAX_PLY][NUM_KILLERS];
+    int history[MAX_PLAYERS][MAX_ENCODED_MOVES];
+
+    // Path data that get_path_data hands back as is while score_walls scores
+    // a wall known to keep it, one bit per player in kept_paths_mask
+    PathData kept_paths[MAX_PLAYERS];
+    int kept_paths_mask = 0;
+
+    chrono::high_resolution_clock::time_point deadline;
+    uint64_t node_count = 0;
+    bool is_aborted = false;
+    const atomic<bool> *stop_signal = nullptr; // set once the main search is done
+
+    vector<ProofEntry> proof_table;     // allocated on the first proof search
+    int proof_winning_rank = 0;         // rank of the better of the two players the proof search is about
+    int proof_attacker = 0;             // player whose win the proof search is after
+
+    vector<MctsNode> mcts_nodes;
+    uint64_t random_state = 0x9E3779B97F4A7C15;
+
+    SearchPool *pool = nullptr;          // set while a Young Brothers Wait search runs
+    SplitPoint *active_split = nullptr; // split point whose children this board is searching
+    Move path[MAX_PLY];                 // moves from the root, by ply
+
+    // A search is cancelled once it is aborted, or once a cutoff stopped a
+    // split point it is working under
+    bool is_cancelled()
+    {
+        if (is_aborted)
+            return true;
+        for (SplitPoint *split = active_split; split != nullptr; split = split->parent)
+            if (split->is_stopped.load(memory_order_relaxed))
+                return true;
+        return false;
+    }
+
+    // Reads the clock on every call; once the deadline has passed or the stop
+    // signal is set, the search stays aborted until the next start_search.
+    bool is_out_of_time()
+    {
+        if (is_cancelled())
+            return true;
+        node_count++;
+        if (!is_aborted && (chrono::high_resolution_clock::now() > deadline ||
+                            (stop_signal != nullptr && stop_signal->load(memory_order_relaxed))))
+            is_aborted = true;
+        return is_aborted;
+    }
+
+    void start_search(chrono::high_resolution_clock::time_point start_time, int time_micro)
+    {
+        deadline = start_time + chrono::microseconds(time_micro);
+        node_count = 0;
+        is_aborted = false;
+    }
 };
 
-void coding_game_main()
+template <int W, int H, int P>
+void play_game(int w, int h, int player_count, int my_id, SearchEngine engine, MultiPlayerSearch multi_player)
 {
-    int w;            // width of the board
-    int h;            // height of the board
-    int player_count; // number of players (2 or 3)
-    int my_id;        // id of my player (0 = 1st player, 1 = 2nd player, ...)
-    cin >> w >> h >> player_count >> my_id;
-    cin.ignore();
-
-    Board board = Board(w, h, player_count);
+    Board<W, H, P> board = Board<W, H, P>(w, h, player_count);
 
     // game loop
     while (1)
@@ -1800,12 +3802,12 @@ void coding_game_main()
 
         // action: LEFT, RIGHT, UP, DOWN or "putX putY putOrientation" to place a
         // wall
-        // 0,08 sec
-        int micros = 90000;
+        int micros = TURN_TIME_MICROS;
 
-        Move move = board.get_num_alive() == 2
-                        ? board.get_best_move(8, 2, micros, my_id)
-                        : board.get_best_move(6, 2, micros, my_id);
+        Move move = engine == SearchEngine::MONTE_CARLO
+                        ? board.get_best_move_mcts(micros, my_id)
+                        : board.get_best_move_iterative(MAX_SEARCH_DEPTH, 2, micros, my_id, SEARCH_THREADS,
+                                                        PARALLEL_SEARCH, multi_player);
         cerr << board.get_num_alive() << endl;
         // board.print_board();
         // cerr << "Move: " << move.score << endl;
@@ -1813,4 +3815,63 @@ void coding_game_main()
     }
 }
 
-int main() { coding_game_main(); }
\ No newline at end of file
+// engines[n] is the search used in games of n players
+void coding_game_main(const SearchEngine *engines, MultiPlayerSearch multi_player)
+{
+    int w;            // width of the board
+    int h;            // height of the board
+    int player_count; // number of players (2 or 3)
+    int my_id;        // id of my player (0 = 1st player, 1 = 2nd player, ...)
+    cin >> w >> h >> player_count >> my_id;
+    cin.ignore();
+
+    // Production games are 9x9, anything else runs on runtime dimensions
+    if (w == 9 && h == 9 && player_count == 2)
+        play_game<9, 9, 2>(w, h, player_count, my_id, engines[player_count], multi_player);
+    else if (w == 9 && h == 9 && player_count == 3)
+        play_game<9, 9, 3>(w, h, player_count, my_id, engines[player_count], multi_player);
+    else
+        play_game<0, 0, 0>(w, h, player_count, my_id, engines[player_count], multi_player);
+}
+
+// --engine-2p=alphabeta|mcts and --engine-3p=alphabeta|mcts pick the search
+// for each player count, --multi-player=paranoid|maxn|brs how alpha-beta
+// treats the opponents in three player games
+int main(int argc, char **argv)
+{
+    SearchEngine engines[MAX_PLAYERS + 1] = {SearchEngine::ALPHA_BETA, SearchEngine::ALPHA_BETA,
+                                             DEFAULT_ENGINE_2P, DEFAULT_ENGINE_3P};
+    MultiPlayerSearch multi_player = MULTI_PLAYER_SEARCH;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--multi-player=", 0) == 0)
+        {
+            string name = arg.substr(15);
+            if (name == "paranoid")
+                multi_player = MultiPlayerSearch::PARANOID;
+            else if (name == "maxn")
+                multi_player = MultiPlayerSearch::MAX_N;
+            else if (name == "brs")
+                multi_player = MultiPlayerSearch::BEST_REPLY;
+            else
+                cerr << "Unknown argument " << arg << endl;
+            continue;
+        }
+
+        int players = 0;
+        if (arg.rfind("--engine-2p=", 0) == 0)
+            players = 2;
+        else if (arg.rfind("--engine-3p=", 0) == 0)
+            players = 3;
+
+        string name = players > 0 ? arg.substr(12) : "";
+        if (name == "alphabeta")
+            engines[players] = SearchEngine::ALPHA_BETA;
+        else if (name == "mcts")
+            engines[players] = SearchEngine::MONTE_CARLO;
+        else
+            cerr << "Unknown argument " << arg << endl;
+    }
+    coding_game_main(engines, multi_player);
+}
\ No newline at end of file